@@ -0,0 +1,50 @@
+/** \file hal.h
+
+  Hardware abstraction for main.c. Everything main.c needs from the chip, the
+  C library of the chip and V-USB comes in through here.
+
+  On the AVR this is just the usual set of avr-libc headers plus usbdrv.h,
+  so the firmware compiles exactly as before. With HOST_BUILD defined,
+  host/hal_host.h replaces all of them with a simulation running on a
+  regular computer, see there.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HAL_H
+#define _HAL_H
+
+#ifndef HOST_BUILD
+
+  #include <avr/io.h>
+  #include <avr/interrupt.h>
+  #include <avr/pgmspace.h>
+  #include <avr/wdt.h>
+  #include <util/delay.h>
+  #ifdef TEMP_ADC
+    #include <avr/sleep.h>
+  #endif
+
+  #include "usbdrv.h"
+
+#else /* HOST_BUILD */
+
+  #include "host/hal_host.h"
+
+#endif /* HOST_BUILD */
+
+#endif /* _HAL_H */
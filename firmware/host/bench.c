@@ -0,0 +1,219 @@
+/** \file bench.c
+
+  Regulation quality benchmark. Runs the firmware against the plant in a
+  fixed set of scenarios and writes one CSV line of figures per scenario,
+  so runs before and after a change can be compared, e.g. with diff.
+
+  Usage: ./bench [-s seed] [scenario ...]
+
+  Without scenario names, all of them run. Each scenario runs in a process
+  of its own, see hal_sim.h.
+
+  Setpoint is the sensor temperature corresponding to TARGET_TEMPERATURE.
+  Figures are for the first radiator, measured on the plant's sensor
+  temperature, sampled every BENCH_SAMPLE seconds after a warmup of
+  BENCH_WARMUP:
+
+  iae:       integral of the absolute deviation from setpoint, in Kh.
+  overshoot: largest deviation past setpoint after the event, in K. Below
+             setpoint for a lowered setpoint, above for all others.
+  settling:  hours from the event until the sensor stays within
+             BENCH_BAND of setpoint, -1 if it never does.
+  moves:     number of motor actuations.
+  motor_ms:  total motor run time.
+  ista:      consumption as modeled by plant.c, in Kh.
+  room_min:  lowest room temperature, in C.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+
+/**
+  Sample period, warmup and length of a scenario, in seconds. Events
+  happen at BENCH_EVENT.
+*/
+#define BENCH_SAMPLE  10
+#define BENCH_WARMUP  (6 * 3600)
+#define BENCH_EVENT   (12 * 3600)
+#define BENCH_LENGTH  (48 * 3600)
+
+/**
+  Settling band around setpoint, in K.
+*/
+#define BENCH_BAND    1.0
+
+enum event {
+  EVENT_NONE,
+  EVENT_SETPOINT,
+  EVENT_COLD_SNAP,
+  EVENT_WINDOW,
+};
+
+static const struct scenario {
+  const char *name;
+  enum event event;
+  double size;    // K for setpoint and cold snap, minutes for window.
+  double noise;   // Timer 1 ticks.
+} scenarios[] = {
+  { "steady",        EVENT_NONE,       0.0,  20.0 },
+  { "setpoint_up",   EVENT_SETPOINT,   3.0,  20.0 },
+  { "setpoint_down", EVENT_SETPOINT,  -3.0,  20.0 },
+  { "cold_snap",     EVENT_COLD_SNAP, -15.0, 20.0 },
+  { "window",        EVENT_WINDOW,    30.0,  20.0 },
+  { "noise_0",       EVENT_NONE,       0.0,   0.0 },
+  { "noise_50",      EVENT_NONE,       0.0,  50.0 },
+  { "noise_150",     EVENT_NONE,       0.0, 150.0 },
+};
+
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+
+/**
+  Move setpoint by delta K without touching the firmware, which has its
+  target compiled in: scale the thermistor, so TARGET_TEMPERATURE reads at
+  the new temperature.
+*/
+static double setpoint_shift(double setpoint, double delta) {
+  double from = setpoint + 273.15, to = setpoint + delta + 273.15;
+
+  plant.thermistor_r25 *= exp(plant.thermistor_beta * (1.0 / from - 1.0 / to));
+  return setpoint + delta;
+}
+
+static void scenario_run(const struct scenario *s, uint64_t seed) {
+  double setpoint, deviation, iae = 0.0, overshoot = 0.0;
+  double room_min = 1000.0, direction = 1.0;
+  uint32_t t, event_at = s->event == EVENT_NONE ? BENCH_WARMUP : BENCH_EVENT;
+  uint32_t settled = event_at;
+
+  plant_init(seed);
+  plant.noise = s->noise;
+  setpoint = plant_celsius(hal_calibration.target_temperature);
+  if (s->event == EVENT_SETPOINT && s->size < 0.0) {
+    direction = -1.0;
+  }
+
+  for (t = BENCH_SAMPLE; t <= BENCH_LENGTH; t += BENCH_SAMPLE) {
+    if (t == BENCH_EVENT) {
+      switch (s->event) {
+        case EVENT_SETPOINT:
+          setpoint = setpoint_shift(setpoint, s->size);
+          break;
+        case EVENT_COLD_SNAP:
+          plant.outdoor_offset = s->size;
+          break;
+        case EVENT_WINDOW:
+          plant.window_open = 1;
+          break;
+        case EVENT_NONE:
+          break;
+      }
+    }
+    if (s->event == EVENT_WINDOW && t == BENCH_EVENT + s->size * 60) {
+      plant.window_open = 0;
+    }
+
+    hal_run(t * 1000000ULL);
+    plant_update();
+
+    if (t <= BENCH_WARMUP) {
+      continue;
+    }
+    deviation = plant.sensor[0] - setpoint;
+    iae += fabs(deviation) * BENCH_SAMPLE / 3600.0;
+    if (t > event_at && deviation * direction > overshoot) {
+      overshoot = deviation * direction;
+    }
+    if (t > event_at && fabs(deviation) > BENCH_BAND) {
+      settled = t;
+    }
+    if (plant.room < room_min) {
+      room_min = plant.room;
+    }
+  }
+
+  printf("%s,%llu,%.3f,%.3f,%.3f,%u,%.0f,%.2f,%.2f\n", s->name,
+         (unsigned long long)seed, iae, overshoot,
+         settled >= BENCH_LENGTH ? -1.0 : (settled - event_at) / 3600.0,
+         plant.motor_moves[0], plant.motor_ms[0], plant.ista[0], room_min);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1;
+  uint8_t wanted[SCENARIOS], i;
+  int opt, status, failed = 0;
+  pid_t pid;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [scenario ...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  memset(wanted, optind >= argc, sizeof(wanted));
+  for ( ; optind < argc; optind++) {
+    for (i = 0; i < SCENARIOS; i++) {
+      if ( ! strcmp(argv[optind], scenarios[i].name)) {
+        wanted[i] = 1;
+        break;
+      }
+    }
+    if (i == SCENARIOS) {
+      fprintf(stderr, "Unknown scenario %s.\n", argv[optind]);
+      return 1;
+    }
+  }
+
+  printf("scenario,seed,iae,overshoot,settling,moves,motor_ms,ista,"
+         "room_min\n");
+  fflush(stdout);
+
+  for (i = 0; i < SCENARIOS; i++) {
+    if ( ! wanted[i]) {
+      continue;
+    }
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      scenario_run(&scenarios[i], seed);
+      fflush(stdout);
+      _exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0 ||
+        ! WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "Scenario %s failed.\n", scenarios[i].name);
+      failed = 1;
+    }
+  }
+
+  return failed;
+}
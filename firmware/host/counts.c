@@ -0,0 +1,193 @@
+/** \file counts.c
+
+  Raw Timer 1 counts from the measurement model in meter.h, and what the
+  firmware's smoothing in temp_measure() makes of them. For studying the
+  filter against realistic noise, clock tuning and USB latency included.
+
+  Usage: ./counts [-s seed] [-n passes] [-t celsius] [-a amplitude]
+                  [-p period] [-u traffic] [-r] [file]
+
+    -s  Seed for all randomness.
+    -n  Main loop passes, about one second each, default 3600.
+    -t  Sensor temperature in C, default where TARGET_TEMPERATURE is.
+    -a  Amplitude of a sine on top of it, in K, default 0.
+    -p  Period of this sine in seconds, default 3600.
+    -u  USB packets per second, default 0.
+    -r  Raw counts only, without running the firmware. Much faster, for
+        long horizons.
+
+  With file, temperatures come from there, one per pass. After the last
+  one, the last one repeats.
+
+  Output, one line per pass:
+
+    pass,celsius,ideal,raw,temp_c,clock
+
+  ideal is the reading without noise, raw the one fed into the pass, temp_c
+  what the firmware filtered from it, empty with -r. clock is the error of
+  the tuned clock at this charge, in percent. A summary of the errors goes
+  to stderr.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+#include "meter.h"
+
+static FILE *input;
+static uint32_t pass, passes = 3600;
+static double mean, amplitude = 0.0, period = 3600.0;
+static double celsius, ideal, clock_error;
+static uint32_t raw;
+
+/**
+  Deviations from ideal of raw and temp_c: count, sum, sum of squares.
+*/
+static double stats[2][3];
+
+static void stats_add(uint8_t which, double value) {
+  stats[which][0] += 1.0;
+  stats[which][1] += value;
+  stats[which][2] += value * value;
+}
+
+
+/**
+  Temperature of the next pass, from file or the sine.
+*/
+static double next_celsius(void) {
+  double value;
+
+  if (input) {
+    if (fscanf(input, "%lf", &value) == 1) {
+      celsius = value;
+    }
+    return celsius;
+  }
+  return mean + amplitude * sin(2.0 * M_PI * pass / period);
+}
+
+static void pass_done(uint8_t filtered) {
+
+  printf("%u,%.3f,%.1f,%u,", pass, celsius, ideal, raw);
+  if (filtered) {
+    printf("%u", hal_state.temp_c[0]);
+    stats_add(1, hal_state.temp_c[0] - ideal);
+  }
+  printf(",%.3f\n", clock_error * 100.0);
+  stats_add(0, raw - ideal);
+}
+
+/**
+  A measurement of the first sensor starts a main loop pass, so the
+  previous one is done. Other measurements of the pass see the same
+  temperature, with their own noise.
+*/
+static uint32_t charge(uint8_t sensor, uint8_t bandgap) {
+  uint32_t ticks;
+
+  if (sensor == HAL_SENSOR_C && ! bandgap) {
+    if (pass) {
+      pass_done(1);
+    }
+    pass++;
+    celsius = next_celsius();
+  }
+  ticks = meter_ticks(celsius, bandgap, hal_time_us / 1e6);
+  if (sensor == HAL_SENSOR_C && ! bandgap) {
+    raw = ticks;
+    ideal = plant_ticks(celsius, 0);
+    clock_error = meter.clock;
+  }
+  return ticks;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1, t;
+  uint8_t raw_only = 0, which;
+  double traffic = 0.0, n;
+  int opt;
+
+  mean = -1000.0;
+  while ((opt = getopt(argc, argv, "s:n:t:a:p:u:r")) != -1) {
+    switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'n': passes = strtoul(optarg, NULL, 0); break;
+      case 't': mean = atof(optarg); break;
+      case 'a': amplitude = atof(optarg); break;
+      case 'p': period = atof(optarg); break;
+      case 'u': traffic = atof(optarg); break;
+      case 'r': raw_only = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [-n passes] [-t celsius] "
+                        "[-a amplitude] [-p period] [-u traffic] [-r] "
+                        "[file]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc && ! (input = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // Thermistor and capacitor of the plant, the plant itself doesn't run.
+  plant_init(seed);
+  meter_init();
+  meter.traffic = traffic;
+  hal_plant.charge = charge;
+  hal_plant.advance = NULL;
+  if (mean < -273.0) {
+    mean = plant_celsius(hal_calibration.target_temperature);
+  }
+  celsius = mean;
+
+  printf("pass,celsius,ideal,raw,temp_c,clock\n");
+  if (raw_only) {
+    for (pass = 1; pass <= passes; pass++) {
+      celsius = next_celsius();
+      raw = meter_ticks(celsius, 0, pass);
+      ideal = plant_ticks(celsius, 0);
+      clock_error = meter.clock;
+      pass_done(0);
+    }
+  }
+  else {
+    for (t = 1; pass <= passes; t++) {
+      hal_run(t * 100000ULL);
+    }
+  }
+
+  fprintf(stderr, "%u charges, %u delayed by USB, %u OSCCAL steps while "
+                  "charging.\n", passes, meter.delayed, meter.steps);
+  for (which = 0; which < (raw_only ? 1 : 2); which++) {
+    n = stats[which][0];
+    if (n > 0.0) {
+      fprintf(stderr, "%-6s - ideal: mean %7.2f, deviation %7.2f ticks\n",
+              which ? "temp_c" : "raw", stats[which][1] / n,
+              sqrt(stats[which][2] / n - (stats[which][1] / n) *
+                                         (stats[which][1] / n)));
+    }
+  }
+
+  return 0;
+}
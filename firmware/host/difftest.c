@@ -0,0 +1,183 @@
+/** \file difftest.c
+
+  Reference run for the differential test against the AVR build, see
+  simavr/difftest.c. Feeds a sequence of raw readings into the firmware and
+  writes, for each main loop pass, what the firmware made of it.
+
+  Usage: ./difftest [-s seed] [-n passes] [file]
+
+    -s  Seed for the built-in sequence.
+    -n  Main loop passes, default 20000.
+
+  Raw readings come from file, one Timer 1 count per line, or from a
+  built-in sequence: noisy readings around levels changing every few
+  minutes, from very warm to very cold, with fast falls, which make
+  temp_future wrap. Normal levels are around TARGET_TEMPERATURE, the very
+  cold ones go beyond 32767, where 16 bit sums wrap on the AVR. After the
+  last reading of a file, the last one repeats.
+
+  The firmware needs DECISION_TRACE, e.g. 'make FEATURES=-DDECISION_TRACE'.
+
+  Output, one line per pass:
+
+    pass,raw,temp_c[,temp_c of the second valve][,decision ...]
+
+  raw is the reading fed into the pass. A decision is written for each
+  record regulate() added to the trace, as 'v<valve> <temp> <temp_future>
+  <reason>', reason being ' ', '+' or '-'.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+
+/**
+  Size of struct trace_record in main.c, and offsets of what we compare.
+*/
+#define TRACE_RECORD       12
+#define TRACE_TEMP         2
+#define TRACE_TEMP_FUTURE  6
+#define TRACE_REASON       10
+#define TRACE_FLAGS        11
+
+static FILE *input;
+static uint32_t pass, passes = 20000;
+static uint16_t raw;
+static double target, level, goal;
+static uint8_t head;
+
+
+/**
+  Next raw reading, from file or the built-in sequence.
+*/
+static uint16_t next_raw(void) {
+  unsigned int count;
+
+  if (input) {
+    if (fscanf(input, "%u", &count) == 1) {
+      raw = count;
+    }
+    return raw;
+  }
+
+  // Every 4 minutes a chance for a new level, a third of them far away,
+  // half of these around and above 32767.
+  if (pass % 240 == 0 && plant_uniform() < 0.25) {
+    if (plant_uniform() < 0.33) {
+      goal = plant_uniform() < 0.5 ? 28000.0 + 12000.0 * plant_uniform() :
+                                      500.0 + 12000.0 * plant_uniform();
+    }
+    else {
+      goal = (4500.0 + 2600.0 * plant_uniform()) * target / 5800.0;
+    }
+  }
+  // Approach it, sometimes fast.
+  level += (goal - level) * (plant_uniform() < 0.1 ? 0.3 : 0.02);
+  level += 20.0 * plant_gauss();
+  if (level < 1.0) {
+    level = 1.0;
+  }
+  if (level > 65535.0) {
+    level = 65535.0;
+  }
+  raw = (uint16_t)level;
+  return raw;
+}
+
+static uint16_t get16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+/**
+  Write the line of the pass just done. Decisions are the records between
+  the previous head and the current one.
+*/
+static void pass_done(void) {
+  const uint8_t *r;
+  uint8_t v;
+
+  printf("%u,%u", pass, raw);
+  for (v = 0; v < hal_state.valves; v++) {
+    printf(",%u", hal_state.temp_c[v]);
+  }
+  while (head != hal_state.trace[0]) {
+    r = hal_state.trace + 1 + head * TRACE_RECORD;
+    printf(",v%u %u %u %c", r[TRACE_FLAGS] & 0x01, get16(r + TRACE_TEMP),
+           get16(r + TRACE_TEMP_FUTURE), r[TRACE_REASON]);
+    head = (head + 1) % hal_state.trace_length;
+  }
+  printf("\n");
+}
+
+/**
+  A measurement of the first sensor starts a main loop pass, so the
+  previous one is done. Other measurements of the pass read the same.
+*/
+static uint32_t charge(uint8_t sensor, uint8_t bandgap) {
+
+  if (sensor == HAL_SENSOR_C && ! bandgap) {
+    if (pass) {
+      pass_done();
+    }
+    pass++;
+    next_raw();
+  }
+  return raw;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1, t;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+    switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'n': passes = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [-n passes] [file]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc && ! (input = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if ( ! hal_state.trace) {
+    fprintf(stderr, "Firmware built without DECISION_TRACE.\n");
+    return 1;
+  }
+
+  // Random numbers only, the plant doesn't run.
+  plant_init(seed);
+  target = hal_calibration.target_temperature;
+  level = goal = target;
+  raw = (uint16_t)target;
+  hal_plant.charge = charge;
+  hal_plant.advance = NULL;
+
+  printf("pass,raw,temp_c,decisions\n");
+  for (t = 1; pass <= passes; t++) {
+    hal_run(t * 100000ULL);
+  }
+
+  return 0;
+}
@@ -0,0 +1,443 @@
+/** \file ensemble.c
+
+  Ensemble simulation for robustness studies: thousands of controllers,
+  each regulating a plant of its own with scattered parameters, advanced in
+  lockstep. State is kept as structure of arrays, one array per variable,
+  and each step is a plain loop over all instances, which the compiler
+  turns into SIMD code.
+
+  Usage: ./ensemble [-N instances] [-s seed] [-d days] [-t outdoor]
+                    [-v spread] [-c comfort] [-a]
+
+    -N  Instances, default 1024.
+    -s  Seed for parameters, weather and sensor noise.
+    -d  Simulated days after a warmup of ENSEMBLE_WARMUP, default 7.
+    -t  Mean outdoor temperature in C, default 0.
+    -v  Relative scatter of plant parameters, default 0.2 for +-20%.
+    -c  Room temperature considered comfortable in C, default 20.
+    -a  Write figures of all instances, not just their distribution.
+
+  This doesn't run main.c, but replicates its default regulation path:
+  temp_filter(), regulate() and the main loop's pass counting. Arithmetic
+  is done in the firmware's types with the wraparounds of the AVR's 16 bit
+  int, e.g. temp_future wrapping around for steep falls of low readings.
+  Calibration values are those main.c was compiled with, see
+  hal_calibration, so 'make FEATURES=-DPREDICTION_STEEPNESS=2' works here,
+  too. Other FEATURES don't apply, use sim.c or bench.c for them.
+
+  The plant is plant.c's model in single precision, without the window and
+  with weather fronts per instance. It's integrated every
+  ENSEMBLE_PLANT_PASSES main loop passes, while the firmware's measurement,
+  filtering and regulation run every pass. Sensor noise is Irwin-Hall, sum
+  of four uniform bytes, close enough to Gaussian and cheap.
+
+  Figures are those of evaluate.c, plus iae as in bench.c, against the
+  instance's setpoint.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+
+/**
+  Main loop passes per plant integration step. A pass takes a second, see
+  poll_a_second() in main.c.
+*/
+#define ENSEMBLE_PLANT_PASSES 10
+
+/**
+  Warmup in seconds, see evaluate.c.
+*/
+#define ENSEMBLE_WARMUP (12 * 3600)
+
+/**
+  Arrays get padded to this many instances, so vector loops have no tails.
+*/
+#define ENSEMBLE_LANES 16
+
+#define KELVIN 273.15f
+
+/**
+  The ensemble. Firmware variables have their main.c names and types.
+*/
+static struct ensemble {
+  uint32_t n;
+
+  // Firmware.
+  uint16_t *temp_temp;        // Raw reading, ISR(ANA_COMP_vect).
+  uint16_t *temp_temp_eight;  // temp_filter().
+  uint16_t *temp_c;
+  uint16_t *temp_last;        // answer[].temp_last.
+  int8_t *move;               // regulate()'s motor_moved, as -1, 0, 1.
+
+  // Plant, see struct plant in plant.h.
+  float *front, *room, *radiator, *sensor, *valve, *motor_s;
+  float *outdoor_mean, *radiator_power, *radiator_capacity, *flow, *loss;
+  float *gain, *thermistor_r25, *noise;
+  uint32_t *random;
+
+  // Sensor reading without noise, at the last plant step.
+  float *ticks;
+
+  // Figures.
+  float *setpoint, *cold, *ista, *iae, *room_sum, *motor_ms;
+  uint32_t *moves;
+} e;
+
+/**
+  Calibration, from main.c.
+*/
+static uint16_t target, hysteresis, response_time, steepness;
+static uint16_t open_ms, close_ms;
+
+static float charge_factor;
+
+
+static void *lanes(size_t size) {
+  void *p;
+
+  if (posix_memalign(&p, 64, ((e.n * size + 63) / 64) * 64)) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  memset(p, 0, ((e.n * size + 63) / 64) * 64);
+  return p;
+}
+
+#define ALLOC(field) e.field = lanes(sizeof(*e.field))
+
+static void ensemble_init(uint32_t instances, double outdoor, double spread) {
+  uint32_t i;
+
+  e.n = (instances + ENSEMBLE_LANES - 1) / ENSEMBLE_LANES * ENSEMBLE_LANES;
+
+  ALLOC(temp_temp); ALLOC(temp_temp_eight); ALLOC(temp_c);
+  ALLOC(temp_last); ALLOC(move);
+  ALLOC(front); ALLOC(room); ALLOC(radiator); ALLOC(sensor); ALLOC(valve);
+  ALLOC(motor_s); ALLOC(outdoor_mean); ALLOC(radiator_power);
+  ALLOC(radiator_capacity); ALLOC(flow); ALLOC(loss); ALLOC(gain);
+  ALLOC(thermistor_r25); ALLOC(noise); ALLOC(random); ALLOC(ticks);
+  ALLOC(setpoint); ALLOC(cold); ALLOC(ista); ALLOC(iae); ALLOC(room_sum);
+  ALLOC(motor_ms); ALLOC(moves);
+
+  target = hal_calibration.target_temperature;
+  hysteresis = hal_calibration.thermistor_hysteresis;
+  response_time = hal_calibration.radiator_response_time;
+  steepness = hal_calibration.prediction_steepness;
+  open_ms = hal_calibration.mot_open_time;
+  close_ms = hal_calibration.mot_close_time;
+
+  charge_factor = plant.capacitor *
+                  log(plant.supply / (plant.supply - plant.reference)) *
+                  (HAL_TICKS_PER_MS * 1000.0);
+
+  #define SCATTER(x) ((x) * (1.0 + spread * (2.0 * plant_uniform() - 1.0)))
+  for (i = 0; i < e.n; i++) {
+    e.outdoor_mean[i] = outdoor + 10.0 * spread * (2.0 * plant_uniform() - 1.0);
+    e.radiator_power[i] = SCATTER(plant.radiator_power);
+    e.radiator_capacity[i] = SCATTER(plant.radiator_capacity);
+    e.flow[i] = SCATTER(plant.flow);
+    e.loss[i] = SCATTER(plant.loss);
+    e.gain[i] = SCATTER(plant.gain);
+    e.thermistor_r25[i] = SCATTER(plant.thermistor_r25);
+    e.noise[i] = SCATTER(plant.noise);
+    e.random[i] = (uint32_t)(plant_uniform() * 4294967295.0) | 1;
+
+    e.room[i] = 20.0f;
+    e.radiator[i] = e.room[i];
+    e.sensor[i] = e.room[i];
+
+    e.setpoint[i] = 1.0 / (1.0 / (25.0 + KELVIN) +
+                           log(target / charge_factor / e.thermistor_r25[i]) /
+                           plant.thermistor_beta) - KELVIN;
+
+    // Static initializer of main.c.
+    e.temp_temp_eight[i] = target * 8L;
+  }
+  #undef SCATTER
+}
+
+
+/* ---- Firmware kernels -------------------------------------------------- */
+
+/**
+  ISR(ANA_COMP_vect) and temp_filter(). Timer 1 is 16 bits wide, longer
+  charges wrap.
+*/
+static void kernel_measure(void) {
+  uint32_t i, x, sum;
+  float ticks;
+
+  for (i = 0; i < e.n; i++) {
+    // xorshift32 for the noise.
+    x = e.random[i];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    e.random[i] = x;
+    sum = (x & 0xff) + ((x >> 8) & 0xff) + ((x >> 16) & 0xff) + (x >> 24);
+
+    // Irwin-Hall of four bytes: mean 510, standard deviation 147.8.
+    ticks = e.ticks[i] + e.noise[i] * ((float)sum - 510.0f) * (1.0f / 147.8f);
+    e.temp_temp[i] = ticks < 1.0f ? 1 : (uint16_t)(uint32_t)(ticks + 0.5f);
+  }
+
+  if (target < 7000) {
+    for (i = 0; i < e.n; i++) {
+      e.temp_temp_eight[i] -= e.temp_c[i];
+      e.temp_temp_eight[i] += e.temp_temp[i];
+      e.temp_c[i] = e.temp_temp_eight[i] / 8;
+    }
+  }
+  else {
+    // On the AVR, int is 16 bits, so this sum wraps.
+    for (i = 0; i < e.n; i++) {
+      e.temp_c[i] = (uint16_t)(e.temp_temp[i] + e.temp_c[i] + 1) / 2;
+    }
+  }
+}
+
+/**
+  regulate(). temp_future is unsigned, so predictions below zero wrap to
+  very high readings, i.e. very cold. Same as on the device.
+*/
+static void kernel_regulate(void) {
+  uint16_t temp, temp_future;
+  uint32_t i;
+
+  for (i = 0; i < e.n; i++) {
+    temp = e.temp_c[i];
+    temp_future = temp + (uint32_t)steepness *
+                  (uint16_t)((int16_t)temp - (int16_t)e.temp_last[i]);
+
+    e.move[i] = temp_future < (uint16_t)(target - hysteresis) ? -1 :
+                temp_future > (uint16_t)(target + hysteresis) ? 1 : 0;
+    e.temp_last[i] = temp;
+  }
+}
+
+/**
+  motor_open() and motor_close() moving the valves, see plant_advance().
+  The firmware is busy meanwhile, so moves lengthen the main loop pass.
+*/
+static void kernel_motor(float stroke_open, float stroke_close) {
+  float ms;
+  uint32_t i;
+
+  for (i = 0; i < e.n; i++) {
+    ms = e.move[i] > 0 ? open_ms : e.move[i] < 0 ? close_ms : 0.0f;
+    e.valve[i] += e.move[i] > 0 ? ms / stroke_open : -ms / stroke_close;
+    e.valve[i] = e.valve[i] > 1.0f ? 1.0f : e.valve[i] < 0.0f ? 0.0f :
+                 e.valve[i];
+    e.motor_s[i] += ms * 0.001f;
+    e.motor_ms[i] += ms;
+    e.moves[i] += e.move[i] != 0;
+  }
+}
+
+
+/* ---- Plant kernel ------------------------------------------------------ */
+
+/**
+  integrate() of plant.c for dt seconds, plus the time motors ran. Then
+  update sensor readings and figures.
+*/
+static void kernel_plant(double time, float dt, float comfort, uint8_t count) {
+  float lag, outdoor, supply, excess, heat, step, deviation, u, daily;
+  uint32_t i, x;
+
+  daily = -plant.outdoor_daily * cos(2.0 * M_PI *
+                                     (fmod(time / 3600.0, 24.0) - 5.0) / 24.0);
+
+  for (i = 0; i < e.n; i++) {
+    step = dt + e.motor_s[i];
+    e.motor_s[i] = 0.0f;
+
+    // Weather front, Ornstein-Uhlenbeck like plant.c, with uniform steps
+    // of the same variance.
+    x = e.random[i];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    e.random[i] = x;
+    u = (float)(x >> 8) * (1.0f / 16777216.0f) * 3.4641016f - 1.7320508f;
+    e.front[i] += -e.front[i] * step / plant.front_time +
+                  plant.outdoor_front * sqrtf(2.0f * step / plant.front_time) * u;
+    outdoor = e.outdoor_mean[i] + e.front[i] + daily;
+
+    supply = plant.supply_base + plant.supply_slope * (20.0f - outdoor);
+    supply = supply > plant.supply_max ? plant.supply_max : supply;
+
+    excess = e.radiator[i] - e.room[i];
+    heat = excess > 0.0f ?
+           e.radiator_power[i] * powf(excess * (1.0f / 50.0f), 1.3f) :
+           e.radiator_power[i] * excess * (1.0f / 50.0f);
+    e.radiator[i] += (e.valve[i] * e.flow[i] * (supply - e.radiator[i]) -
+                      heat) * step / e.radiator_capacity[i];
+
+    lag = 1.0f - expf(-step / plant.sensor_time);
+    e.sensor[i] += (e.radiator[i] - e.sensor[i]) * lag;
+    e.ticks[i] = e.thermistor_r25[i] * charge_factor *
+                 expf(plant.thermistor_beta *
+                      (1.0f / (e.sensor[i] + KELVIN) - 1.0f / (25.0f + KELVIN)));
+
+    e.room[i] += (heat + e.gain[i] - e.loss[i] * (e.room[i] - outdoor)) *
+                 step / plant.room_capacity;
+
+    if ( ! count) {
+      continue;
+    }
+    if (e.radiator[i] > plant.ista_start && excess > plant.ista_delta) {
+      e.ista[i] += excess * step * (1.0f / 3600.0f);
+    }
+    if (e.room[i] < comfort) {
+      e.cold[i] += (comfort - e.room[i]) * step * (1.0f / 3600.0f);
+    }
+    deviation = e.sensor[i] - e.setpoint[i];
+    e.iae[i] += fabsf(deviation) * step * (1.0f / 3600.0f);
+    e.room_sum[i] += e.room[i];
+  }
+}
+
+
+/* ---- Results ----------------------------------------------------------- */
+
+static int compare_float(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void distribution(const char *name, const float *values, uint32_t n,
+                         float scale) {
+  float *sorted = malloc(n * sizeof(float)), mean = 0.0f;
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    sorted[i] = values[i] * scale;
+    mean += sorted[i];
+  }
+  qsort(sorted, n, sizeof(float), compare_float);
+  printf("%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", name, mean / n, sorted[0],
+         sorted[n / 20], sorted[n / 2], sorted[n - 1 - n / 20],
+         sorted[n - 1]);
+  free(sorted);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1, pass, passes, warmup;
+  uint32_t instances = 1024, samples, i;
+  double days = 7.0, outdoor = 0.0, spread = 0.2, comfort = 20.0, seconds;
+  uint16_t time = 0;
+  uint8_t all = 0;
+  struct timespec start, end;
+  float *moves;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "N:s:d:t:v:c:a")) != -1) {
+    switch (opt) {
+      case 'N': instances = atoi(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'd': days = atof(optarg); break;
+      case 't': outdoor = atof(optarg); break;
+      case 'v': spread = atof(optarg); break;
+      case 'c': comfort = atof(optarg); break;
+      case 'a': all = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-N instances] [-s seed] [-d days] "
+                        "[-t outdoor] [-v spread] [-c comfort] [-a]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (instances < 1 || spread < 0.0 || spread >= 1.0) {
+    fprintf(stderr, "Invalid instances or spread.\n");
+    return 1;
+  }
+
+  // Default parameters and the random generator, no firmware runs.
+  plant_init(seed);
+  ensemble_init(instances, outdoor, spread);
+
+  warmup = ENSEMBLE_WARMUP / ENSEMBLE_PLANT_PASSES * ENSEMBLE_PLANT_PASSES;
+  passes = warmup + (uint64_t)(days * 86400.0) /
+                    ENSEMBLE_PLANT_PASSES * ENSEMBLE_PLANT_PASSES;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  kernel_plant(0.0, 0.0f, comfort, 0);
+  for (pass = 1; pass <= passes; pass++) {
+    // Main loop of main.c.
+    kernel_measure();
+    time++;
+    if (time > response_time) {
+      kernel_regulate();
+      kernel_motor(plant.stroke_open, plant.stroke_close);
+      time = 0;
+    }
+
+    if (pass % ENSEMBLE_PLANT_PASSES == 0) {
+      kernel_plant(pass, ENSEMBLE_PLANT_PASSES, comfort, pass > warmup);
+    }
+    if (pass == warmup) {
+      for (i = 0; i < e.n; i++) {
+        e.motor_ms[i] = 0.0f;
+        e.moves[i] = 0;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  samples = (passes - warmup) / ENSEMBLE_PLANT_PASSES;
+  moves = malloc(instances * sizeof(float));
+  for (i = 0; i < instances; i++) {
+    moves[i] = e.moves[i];
+    e.room_sum[i] /= samples;
+  }
+
+  if (all) {
+    printf("instance,cold,ista,iae,moves,motor_ms,room_mean\n");
+    for (i = 0; i < instances; i++) {
+      printf("%u,%.3f,%.2f,%.3f,%u,%.0f,%.2f\n", i, e.cold[i], e.ista[i],
+             e.iae[i], e.moves[i], e.motor_ms[i], e.room_sum[i]);
+    }
+  }
+  else {
+    printf("figure,mean,min,p5,median,p95,max\n");
+    distribution("cold", e.cold, instances, 1.0f);
+    distribution("ista", e.ista, instances, 1.0f);
+    distribution("iae", e.iae, instances, 1.0f);
+    distribution("moves", moves, instances, 1.0f);
+    distribution("motor_ms", e.motor_ms, instances, 1.0f);
+    distribution("room_mean", e.room_sum, instances, 1.0f);
+  }
+  free(moves);
+
+  fprintf(stderr, "%u instances, %.1f days: %.0f controller steps per "
+                  "second.\n", instances, passes / 86400.0,
+          (double)passes * e.n / seconds);
+
+  return 0;
+}
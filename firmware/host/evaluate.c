@@ -0,0 +1,104 @@
+/** \file evaluate.c
+
+  Figures of merit of one firmware build against the plant, as one CSV line
+  without header. sweep.c runs this for each combination of calibration
+  values, but it's just as useful for judging a single build.
+
+  Usage: ./evaluate [-s seed] [-d days] [-t outdoor] [-c comfort]
+
+    -s  Seed for weather and sensor noise. Same seed, same run.
+    -d  Simulated days after a warmup of EVALUATE_WARMUP, default 7.
+    -t  Mean outdoor temperature in C, default 0.
+    -c  Room temperature considered comfortable in C, default 20.
+
+  Figures, all for the first radiator and sampled every EVALUATE_SAMPLE
+  seconds after warmup:
+
+  cold:      integral of the room being below comfort, in Kh. Comfort.
+  ista:      consumption as modeled by plant.c, in Kh.
+  moves:     number of motor actuations.
+  motor_ms:  total motor run time. Together with moves, valve wear.
+  room_mean: mean room temperature, in C.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+
+/**
+  Sample period and warmup, in seconds. Warmup gets the radiator from cold
+  to regulated and the weather away from its start values.
+*/
+#define EVALUATE_SAMPLE  60
+#define EVALUATE_WARMUP  (12 * 3600)
+
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1, end, t;
+  double days = 7.0, outdoor = 0.0, comfort = 20.0;
+  double cold = 0.0, room_sum = 0.0, ista_start = 0.0;
+  uint32_t moves_start = 0, samples = 0;
+  double motor_start = 0.0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:d:t:c:")) != -1) {
+    switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'd': days = atof(optarg); break;
+      case 't': outdoor = atof(optarg); break;
+      case 'c': comfort = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [-d days] [-t outdoor] "
+                        "[-c comfort]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  plant_init(seed);
+  plant.outdoor_mean = outdoor;
+
+  end = EVALUATE_WARMUP + (uint64_t)(days * 86400.0);
+  for (t = EVALUATE_SAMPLE; t <= end; t += EVALUATE_SAMPLE) {
+    hal_run(t * 1000000ULL);
+    plant_update();
+
+    if (t == EVALUATE_WARMUP) {
+      ista_start = plant.ista[0];
+      moves_start = plant.motor_moves[0];
+      motor_start = plant.motor_ms[0];
+    }
+    if (t <= EVALUATE_WARMUP) {
+      continue;
+    }
+    if (plant.room < comfort) {
+      cold += (comfort - plant.room) * EVALUATE_SAMPLE / 3600.0;
+    }
+    room_sum += plant.room;
+    samples++;
+  }
+
+  printf("%.3f,%.2f,%u,%.0f,%.2f\n", cold, plant.ista[0] - ista_start,
+         plant.motor_moves[0] - moves_start, plant.motor_ms[0] - motor_start,
+         samples ? room_sum / samples : plant.room);
+
+  return 0;
+}
@@ -0,0 +1,310 @@
+/** \file hal_host.c
+
+  Simulated chip for the host build of main.c, see hal_host.h and
+  hal_sim.h.
+
+  Simulated is just enough to run the measurement and regulation code:
+
+  - Time advances in delays only. Code between delays takes no time.
+    Except for usbPoll() called again at the same time, which is a busy
+    wait for USB, e.g. FRAME_SYNC's frame_wait(). It advances time to the
+    next SOF.
+
+  - A charge starts when a sensor pin gets set with the comparator interrupt
+    enabled. When the charge time reported by the plant elapsed, TCNT1 gets
+    this time and ISR(ANA_COMP_vect) runs, once per charge.
+
+  - Motor pins, including OC1A/OC1B of MOTOR_SOFT_START, are reported to the
+    plant as running motors. PWM duty is ignored.
+
+  - USB SOF comes every millisecond. Requests get served in usbPoll().
+
+  Not simulated are ripple pulses (RIPPLE_COUNT), TEMP_ADC and the heat
+  demand PWM output, besides reading OCR0A.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "hal_host.h"
+#include "hal_sim.h"
+#include "../pinio.h"
+
+
+/* ---- Registers --------------------------------------------------------- */
+
+volatile uint8_t PINB, PORTB, DDRB;
+volatile uint8_t PIND, PORTD, DDRD;
+volatile uint8_t ACSR;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+volatile uint8_t TCNT1H, TCNT1L;
+volatile uint8_t GIMSK, PCMSK, EIFR;
+
+uchar *usbMsgPtr;
+volatile uchar usbSofCount;
+
+
+/* ---- Simulator state --------------------------------------------------- */
+
+struct hal_plant hal_plant;
+uint64_t hal_time_us;
+
+static uint64_t until_us;
+static ucontext_t sim_context, firmware_context;
+static uint8_t started;
+
+/**
+  The charge in progress. sensor is HAL_SENSORS while there is none.
+*/
+static struct {
+  uint8_t sensor;
+  uint8_t done;
+  uint32_t ticks;
+  uint64_t elapsed_us;
+} charge = { HAL_SENSORS, 0, 0, 0 };
+
+/**
+  The request queued by hal_usb_request().
+*/
+static struct {
+  uint8_t pending;
+  uint8_t data[8];
+  uint8_t answer[256];
+  uint8_t len;
+} queued;
+
+
+/* ---- Pins -------------------------------------------------------------- */
+
+/**
+  The sensor currently charging the capacitor, HAL_SENSORS for none. If more
+  than one pin is set, the lowest numbered sensor wins.
+*/
+static uint8_t charging_sensor(void) {
+
+  if (TEMP_C_WPORT & MASK(TEMP_C_PIN)) {
+    return HAL_SENSOR_C;
+  }
+  if (TEMP_C2_WPORT & MASK(TEMP_C2_PIN)) {
+    return HAL_SENSOR_C2;
+  }
+  if (TEMP_V_WPORT & MASK(TEMP_V_PIN)) {
+    return HAL_SENSOR_V;
+  }
+  if (TEMP_R_WPORT & MASK(TEMP_R_PIN)) {
+    return HAL_SENSOR_R;
+  }
+  return HAL_SENSORS;
+}
+
+/**
+  Motor directions from the pins. OC1A/OC1B override MOT_OPEN/MOT_CLOSE
+  while connected.
+*/
+static void motor_state(int8_t motor[2]) {
+  uint8_t open, close;
+
+  open = (MOT_OPEN_WPORT & MASK(MOT_OPEN_PIN)) ||
+         (TCCR1A & (1 << COM1A1));
+  close = (MOT_CLOSE_WPORT & MASK(MOT_CLOSE_PIN)) ||
+          (TCCR1A & (1 << COM1B1));
+  motor[0] = open - close;
+
+  open = (MOT2_OPEN_WPORT & MASK(MOT2_OPEN_PIN)) != 0;
+  close = (MOT2_CLOSE_WPORT & MASK(MOT2_CLOSE_PIN)) != 0;
+  motor[1] = open - close;
+}
+
+
+/* ---- Time -------------------------------------------------------------- */
+
+/**
+  Track start and end of charges. A charge ends when the ISR discharges,
+  also when main.c gives up on it.
+*/
+static void charge_update(void) {
+  uint8_t sensor = charging_sensor();
+
+  if ( ! (ACSR & (1 << ACIE))) {
+    sensor = HAL_SENSORS;
+  }
+  if (sensor == charge.sensor) {
+    return;
+  }
+
+  charge.sensor = sensor;
+  charge.done = 0;
+  charge.elapsed_us = 0;
+  charge.ticks = 0;
+  if (sensor < HAL_SENSORS && hal_plant.charge) {
+    charge.ticks = hal_plant.charge(sensor, (ACSR & (1 << ACBG)) != 0);
+  }
+}
+
+/**
+  Advance the simulated clock by us microseconds, stopping in between to
+  trigger the comparator. Switches back to the simulator when time is up.
+*/
+void hal_delay_us(uint32_t us) {
+  int8_t motor[2];
+  uint32_t step;
+  uint64_t trigger_us;
+
+  while (us) {
+    charge_update();
+    motor_state(motor);
+
+    step = us;
+    if (until_us - hal_time_us < step) {
+      step = until_us - hal_time_us;
+    }
+    trigger_us = 0;
+    if (charge.sensor < HAL_SENSORS && ! charge.done && charge.ticks) {
+      trigger_us = (charge.ticks * 1000ULL + HAL_TICKS_PER_MS - 1) /
+                   HAL_TICKS_PER_MS;
+      if (trigger_us > charge.elapsed_us &&
+          trigger_us - charge.elapsed_us < step) {
+        step = trigger_us - charge.elapsed_us;
+      }
+    }
+
+    if ((hal_time_us + step) / 1000 != hal_time_us / 1000) {
+      usbSofCount += (hal_time_us + step) / 1000 - hal_time_us / 1000;
+    }
+    hal_time_us += step;
+    us -= step;
+    charge.elapsed_us += step;
+    if (hal_plant.advance) {
+      hal_plant.advance(step, motor);
+    }
+
+    if (trigger_us && charge.elapsed_us >= trigger_us) {
+      charge.done = 1;
+      // Timer 1 is 16 bits wide, longer charges wrap, as on the device.
+      TCNT1 = (uint16_t)charge.ticks;
+      ANA_COMP_vect();
+    }
+
+    if (hal_time_us >= until_us) {
+      swapcontext(&firmware_context, &sim_context);
+    }
+  }
+}
+
+
+/* ---- USB --------------------------------------------------------------- */
+
+void usbInit(void) {
+}
+
+void usbPoll(void) {
+  static uint64_t last_us = UINT64_MAX;
+  usbRequest_t *rq = (void *)queued.data;
+  usbMsgLen_t len;
+
+  if ( ! queued.pending) {
+    // Busy waiting, nothing else would move time forward.
+    if (hal_time_us == last_us) {
+      hal_delay_us(1000 - hal_time_us % 1000);
+    }
+    last_us = hal_time_us;
+    return;
+  }
+
+  len = usbFunctionSetup(queued.data);
+  if (len > rq->wLength.word) {
+    len = rq->wLength.word;
+  }
+  if (len) {
+    memcpy(queued.answer, usbMsgPtr, len);
+  }
+  queued.len = len;
+  queued.pending = 0;
+}
+
+uchar usbInterruptIsReady(void) {
+  return 1;
+}
+
+void usbSetInterrupt(uchar *data, uchar len) {
+
+  if (hal_plant.interrupt) {
+    hal_plant.interrupt(data, len);
+  }
+}
+
+int hal_usb_request(uint8_t request, uint16_t value, uint16_t index,
+                    uint8_t *data, uint8_t len) {
+  usbRequest_t *rq = (void *)queued.data;
+  uint64_t timeout = hal_time_us + 60000000ULL;
+
+  rq->bmRequestType = 0xC0;
+  rq->bRequest = request;
+  rq->wValue.word = value;
+  rq->wIndex.word = index;
+  rq->wLength.word = len;
+  queued.pending = 1;
+
+  while (queued.pending && hal_time_us < timeout) {
+    hal_run(hal_time_us + 1000);
+  }
+  if (queued.pending) {
+    queued.pending = 0;
+    return -1;
+  }
+
+  if (data && queued.len) {
+    memcpy(data, queued.answer, queued.len);
+  }
+  return queued.len;
+}
+
+
+/* ---- Run control ------------------------------------------------------- */
+
+static void firmware_start(void) {
+
+  firmware_main();
+
+  fprintf(stderr, "hal_host: firmware returned from main().\n");
+  exit(1);
+}
+
+void hal_run(uint64_t until) {
+  static char stack[1 << 18];
+
+  until_us = until;
+  if (hal_time_us >= until_us) {
+    return;
+  }
+
+  if ( ! started) {
+    started = 1;
+    getcontext(&firmware_context);
+    firmware_context.uc_stack.ss_sp = stack;
+    firmware_context.uc_stack.ss_size = sizeof(stack);
+    firmware_context.uc_link = NULL;
+    makecontext(&firmware_context, firmware_start, 0);
+  }
+  swapcontext(&sim_context, &firmware_context);
+}
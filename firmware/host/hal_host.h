@@ -0,0 +1,194 @@
+/** \file hal_host.h
+
+  Host side of hal.h. Lets main.c compile for and run on a regular computer
+  with HOST_BUILD defined, see host/Makefile.
+
+  Registers are plain variables, interrupt service routines plain functions.
+  Time is simulated: _delay_ms() doesn't wait, it advances the simulated
+  clock in hal_host.c, firing the comparator interrupt when the capacitor
+  is charged and letting the plant model (see hal_sim.h) follow. As main.c
+  spends virtually all of its time in delays, a season of regulation runs in
+  seconds.
+
+  Only what main.c actually uses is simulated. With a feature using more of
+  the chip, add the missing pieces here and in hal_host.c.
+
+  Note that int has 32 bits here, 16 bits on the AVR. Code relying on 16-bit
+  integer promotion behaves differently on the host.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HAL_HOST_H
+#define _HAL_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hal_sim.h"
+
+#ifdef TEMP_ADC
+  #error TEMP_ADC is not simulated on the host.
+#endif
+#ifdef ASM_COMPARATOR_ISR
+  #error ASM_COMPARATOR_ISR is AVR assembly, use the C version on the host.
+#endif
+
+
+/* ---- Registers --------------------------------------------------------- */
+
+/**
+  I/O registers, see hal_host.c. Same names and bit numbers as on the
+  ATtiny2313. Timer 1 doesn't run, hal_host.c sets TCNT1 to the charge time
+  right before calling ISR(ANA_COMP_vect). TCNT1H and TCNT1L just take
+  main.c's clearing writes.
+*/
+extern volatile uint8_t PINB, PORTB, DDRB;
+extern volatile uint8_t PIND, PORTD, DDRD;
+extern volatile uint8_t ACSR;
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+extern volatile uint8_t TCNT1H, TCNT1L;
+extern volatile uint8_t GIMSK, PCMSK, EIFR;
+
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB3   3
+#define PINB4   4
+#define PINB5   5
+#define PINB6   6
+#define PINB7   7
+#define PIND0   0
+#define PIND1   1
+#define PIND2   2
+#define PIND3   3
+#define PIND4   4
+#define PIND5   5
+#define PIND6   6
+
+// ACSR
+#define ACD     7
+#define ACBG    6
+#define ACO     5
+#define ACI     4
+#define ACIE    3
+#define ACIC    2
+#define ACIS1   1
+#define ACIS0   0
+
+// TCCR0A, TCCR1A, TCCR1B
+#define COM0A1  7
+#define COM0A0  6
+#define WGM01   1
+#define WGM00   0
+#define COM1A1  7
+#define COM1A0  6
+#define COM1B1  5
+#define COM1B0  4
+#define WGM11   1
+#define WGM10   0
+#define WGM13   4
+#define WGM12   3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+
+// GIMSK, EIFR, PCMSK
+#define PCIE    5
+#define PCIF    5
+#define PCINT6  6
+
+
+/* ---- Interrupts -------------------------------------------------------- */
+
+/**
+  An ISR is a plain function, called by hal_host.c when its condition
+  arises. There is no concurrency, so locking interrupts is a no-op.
+*/
+#define ISR(vector, ...)        void vector(void); void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void) {}
+#define ISR_NOBLOCK
+#define cli()                   do { } while (0)
+#define sei()                   do { } while (0)
+
+void ANA_COMP_vect(void);
+void PCINT_vect(void);
+
+
+/* ---- Delays and other library functions -------------------------------- */
+
+/**
+  Delays advance the simulated clock, see hal_host.c.
+*/
+void hal_delay_us(uint32_t us);
+
+#define _delay_ms(ms)           hal_delay_us((uint32_t)((ms) * 1000UL))
+#define _delay_us(us)           hal_delay_us((uint32_t)(us))
+
+#define wdt_disable()           do { } while (0)
+#define PROGMEM
+
+
+/* ---- V-USB ------------------------------------------------------------- */
+
+/**
+  The part of usbdrv.h main.c uses. Not usbdrv.h itself, as its usbWord_t
+  assumes a 16-bit unsigned, which has 32 bits here.
+
+  Requests queued by hal_usb_request() in hal_sim.h reach usbFunctionSetup()
+  from within usbPoll(), like on the real device.
+*/
+typedef uint8_t uchar;
+typedef uint8_t usbMsgLen_t;
+
+typedef union usbWord {
+  uint16_t word;
+  uint8_t bytes[2];
+} usbWord_t;
+
+typedef struct usbRequest {
+  uchar bmRequestType;
+  uchar bRequest;
+  usbWord_t wValue;
+  usbWord_t wIndex;
+  usbWord_t wLength;
+} usbRequest_t;
+
+extern uchar *usbMsgPtr;
+extern volatile uchar usbSofCount;
+
+usbMsgLen_t usbFunctionSetup(uchar data[8]);
+
+void usbInit(void);
+void usbPoll(void);
+uchar usbInterruptIsReady(void);
+void usbSetInterrupt(uchar *data, uchar len);
+
+#define usbDeviceConnect()      do { } while (0)
+#define usbDeviceDisconnect()   do { } while (0)
+
+
+/**
+  main.c's main() becomes a function hal_host.c runs in a context of its
+  own, see hal_run() in hal_sim.h.
+*/
+#define main firmware_main
+int firmware_main(void);
+
+#endif /* _HAL_HOST_H */
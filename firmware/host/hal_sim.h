@@ -0,0 +1,133 @@
+/** \file hal_sim.h
+
+  Simulator side of the host build, see hal_host.h. This is what programs
+  driving the host compiled firmware include: run control, the plant hooks
+  and USB requests.
+
+  The firmware runs in a context of its own (ucontext), so hal_run() can stop
+  it at any point in simulated time and continue later. Statics of main.c
+  can't be reset, so it's one firmware run per process. Fork to simulate
+  more than one.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HAL_SIM_H
+#define _HAL_SIM_H
+
+#include <stdint.h>
+
+/**
+  Sensors as numbered in main.c (SENSOR_C ... SENSOR_R).
+*/
+#define HAL_SENSOR_C    0
+#define HAL_SENSOR_C2   1
+#define HAL_SENSOR_V    2
+#define HAL_SENSOR_R    3
+#define HAL_SENSORS     4
+
+/**
+  Timer 1 runs at F_CPU / 8 while measuring, 1.6 ticks per microsecond.
+*/
+#define HAL_TICKS_PER_MS 1600
+
+/**
+  Hooks into the simulated world. All of them are optional, a NULL hook does
+  nothing, a NULL charge hook lets the comparator never trigger.
+
+  charge: Timer 1 ticks a charge of the capacitor through this sensor takes
+          until the comparator triggers. bandgap tells the comparator
+          compares against the internal reference instead of AIN1, see
+          SUPPLY_COMPENSATION. Return 0 for never. Called once per charge,
+          at its start.
+
+  advance: simulated time advanced by us microseconds. motor[] is the
+           direction each valve motor runs: 1 opening, -1 closing, 0 off.
+
+  interrupt: the firmware sent len bytes on the interrupt-in endpoint.
+*/
+struct hal_plant {
+  uint32_t (*charge)(uint8_t sensor, uint8_t bandgap);
+  void (*advance)(uint32_t us, const int8_t motor[2]);
+  void (*interrupt)(const uint8_t *data, uint8_t len);
+};
+
+extern struct hal_plant hal_plant;
+
+/**
+  Calibration values the firmware was compiled with, see "Start calibration
+  values" in main.c.
+*/
+struct hal_calibration {
+  uint16_t target_temperature;
+  uint16_t thermistor_hysteresis;
+  uint16_t radiator_response_time;
+  uint16_t prediction_steepness;
+  uint16_t mot_open_time;
+  uint16_t mot_close_time;
+};
+
+extern const struct hal_calibration hal_calibration;
+
+/**
+  Firmware state, for comparing runs. Read only, and best from the charge
+  hook, when the firmware is done with the previous main loop pass.
+
+  valves:       NUM_VALVES, entries of temp_c.
+  temp_c:       filtered readings.
+  trace:        DECISION_TRACE ring, a head byte followed by trace_length
+                records, layout as struct trace_record in main.c. NULL
+                without DECISION_TRACE.
+  regulations:  regulation steps so far, all valves at once. Wraps.
+
+  Packed, as the firmware gets compiled with -fpack-struct, but simulators
+  not.
+*/
+struct __attribute__((packed)) hal_state {
+  uint8_t valves;
+  const uint16_t *temp_c;
+  const uint8_t *trace;
+  uint8_t trace_length;
+  const uint16_t *regulations;
+};
+
+extern const struct hal_state hal_state;
+
+/**
+  Simulated time since reset, in microseconds.
+*/
+extern uint64_t hal_time_us;
+
+/**
+  Run the firmware until the simulated clock reaches until_us. The first
+  call starts it. Returns when time is up, the firmware waits in a delay
+  then.
+*/
+void hal_run(uint64_t until_us);
+
+/**
+  Send a vendor request as terminal.py does: queue it for the next
+  usbPoll() of the firmware, run the firmware until it's served, then copy
+  the answer, up to len bytes, to data. Returns the number of bytes copied,
+  or -1 if the firmware didn't poll USB within a minute of simulated time.
+
+  Runs the firmware, so don't call this from one of the hooks.
+*/
+int hal_usb_request(uint8_t request, uint16_t value, uint16_t index,
+                    uint8_t *data, uint8_t len);
+
+#endif /* _HAL_SIM_H */
@@ -0,0 +1,182 @@
+/** \file meter.c
+
+  Measurement model for the host build, see meter.h.
+
+  USB frames come every millisecond of the host's clock. The firmware starts
+  a charge on its own clock, after a main loop pass of varying length, so
+  its phase in the frame is random. Timer 0 runs at f/64 of the actual
+  clock, its count at the frame before a charge is random, as many frames
+  passed since the last one.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "meter.h"
+#include "plant.h"
+#include "hal_sim.h"
+
+/**
+  Same as in osctune.h, which can't be included here.
+*/
+#define TIMER0_PRESCALING           64
+#define TOLERATED_DEVIATION_PPT     5
+#define EXPECTED_TIMER0_INCREMENT   ((F_CPU / (1000 * TIMER0_PRESCALING)) & 0xff)
+#define TOLERATED_DEVIATION         (TOLERATED_DEVIATION_PPT * F_CPU / \
+                                     (1000000 * TIMER0_PRESCALING))
+
+#define FRAME 0.001
+
+/**
+  Charges longer than this never end, Timer 1 overflowed many times and
+  main.c gave up long before.
+
+  Unit: seconds
+*/
+#define METER_LONGEST 1.0
+
+struct meter meter;
+
+
+/**
+  Bring clock drift up to time and let osctune.h tune it in. Over the
+  hundreds of frames between charges, every error Timer 0 can see gets
+  corrected, so this is what's left.
+*/
+static void clock_update(double time) {
+  double dt = time - meter.time, a, band;
+  uint16_t i;
+
+  if (dt > 0.0) {
+    a = exp(-dt / meter.wander_time);
+    meter.drift = meter.drift * a +
+                  meter.wander * sqrt(1.0 - a * a) * plant_gauss();
+    meter.time = time;
+  }
+
+  band = (double)TOLERATED_DEVIATION / EXPECTED_TIMER0_INCREMENT;
+  meter.clock = meter.drift + meter.osccal * meter.osccal_step;
+  for (i = 0; i < 1000 && fabs(meter.clock) > band; i++) {
+    meter.osccal += meter.clock > 0.0 ? -1 : 1;
+    meter.clock = meter.drift + meter.osccal * meter.osccal_step;
+  }
+  // Hunting ends on either side.
+  if (fabs(meter.clock) > band && plant_uniform() < 0.5) {
+    meter.osccal += meter.clock > 0.0 ? -1 : 1;
+    meter.clock = meter.drift + meter.osccal * meter.osccal_step;
+  }
+}
+
+uint32_t meter_ticks(double celsius, uint8_t bandgap, double time) {
+  double reference = bandgap ? plant.bandgap : plant.reference;
+  double charge, trigger, t, next, f, timer0, ticks = 0.0, since, busy;
+  int32_t count, last = 0, deviation;
+
+  clock_update(time);
+
+  reference += meter.offset + meter.noise * plant_gauss();
+  if (reference >= plant.supply) {
+    return 0;
+  }
+  charge = plant_ohms(celsius) * plant.capacitor *
+           log(plant.supply / (plant.supply - reference));
+  if (charge > METER_LONGEST) {
+    return 0;
+  }
+  trigger = time + charge;
+
+  // Next frame at a random phase, Timer 0 count at the last one random,
+  // counted on since.
+  f = F_CPU * (1.0 + meter.clock);
+  t = time;
+  next = t + (1.0 - plant_uniform()) * FRAME;
+  timer0 = plant_uniform() + (FRAME - (next - t)) * f / TIMER0_PRESCALING;
+
+  while (next < trigger) {
+    ticks += (next - t) * f / 8.0;
+    timer0 += (next - t) * f / TIMER0_PRESCALING;
+    t = next;
+    next += FRAME;
+
+    // osctune.h, on the keep-alive starting this frame.
+    count = (int32_t)timer0;
+    deviation = count - last - EXPECTED_TIMER0_INCREMENT;
+    last = count;
+    if (deviation > TOLERATED_DEVIATION) {
+      meter.osccal--;
+      meter.steps++;
+    }
+    else if (deviation < -TOLERATED_DEVIATION) {
+      meter.osccal++;
+      meter.steps++;
+    }
+    meter.clock = meter.drift + meter.osccal * meter.osccal_step;
+    f = F_CPU * (1.0 + meter.clock);
+  }
+  ticks += (trigger - t) * f / 8.0;
+
+  // Comparator interrupt waits for a running USB interrupt.
+  since = trigger - (next - FRAME);
+  busy = meter.sof_cycles / f;
+  if (since < busy) {
+    ticks += (busy - since) * f / 8.0;
+    meter.delayed++;
+  }
+  else if (plant_uniform() < meter.traffic * meter.packet_cycles / f) {
+    ticks += plant_uniform() * meter.packet_cycles / 8.0;
+    meter.delayed++;
+  }
+  ticks += meter.latch_cycles / 8.0;
+
+  return ticks < 1.0 ? 1 : (uint32_t)ticks;
+}
+
+static uint32_t meter_charge(uint8_t sensor, uint8_t bandgap) {
+  return meter_ticks(plant_sensor(sensor), bandgap, hal_time_us / 1e6);
+}
+
+void meter_init(void) {
+
+  memset(&meter, 0, sizeof(meter));
+
+  // About what temperature and supply changes of a room do to the RC
+  // oscillator. One OSCCAL step of the ATtiny2313 at 12.8 MHz is about
+  // 0.75 %, below twice the tolerated 0.5 %, so osctune.h settles.
+  meter.wander = 0.01;
+  meter.wander_time = 3600.0;
+  meter.osccal_step = 0.0075;
+
+  // Keep-alive handling including the SOF hook. A transaction, token plus
+  // data or handshake, takes some 1000 cycles at low speed. There's no
+  // traffic without a host program polling, an interrupt-in endpoint gets
+  // polled every USB_CFG_INTR_POLL_INTERVAL.
+  meter.sof_cycles = 80.0;
+  meter.packet_cycles = 1000.0;
+  meter.traffic = 0.0;
+
+  // Comparator input offset is up to 10 mV, see the datasheet.
+  meter.latch_cycles = 28.0;
+  meter.offset = 0.0;
+  meter.noise = 0.002;
+
+  meter.drift = meter.wander * plant_gauss();
+  clock_update(0.0);
+
+  hal_plant.charge = meter_charge;
+}
@@ -0,0 +1,120 @@
+/** \file meter.h
+
+  Measurement model for the host build: what Timer 1 reads when the
+  comparator triggers, as on the device. Replaces the gaussian noise of
+  plant.h's sensors with the mechanisms behind it:
+
+  - The capacitor charges through the thermistor, plant.h's beta curve,
+    capacitor and supply, until it reaches the comparator's reference plus
+    offset and noise.
+
+  - Timer 1 runs at f/8 of the actual clock, the RC oscillator. It wanders
+    off F_CPU and osctune.h pulls it back, one OSCCAL step at a time, on
+    each USB frame where Timer 0 counted more than TOLERATED_DEVIATION off.
+    Frames during a charge are stepped through, so a correction in the
+    middle of one shows up in its reading.
+
+  - The comparator interrupt waits while the USB interrupt runs, for the
+    keep-alive starting each frame and for packets of other traffic. Timer
+    1 counts on meanwhile. Latching it in ISR(ANA_COMP_vect) takes some
+    cycles more.
+
+  All state and parameters live in the global struct meter. meter_init()
+  sets defaults, callers may change any parameter afterwards. Randomness
+  comes from plant.h's generator, so call plant_init() first.
+
+  Between charges, clock drift advances in closed form, the firmware's
+  slower timing isn't modelled. A charge costs a few dozen frame steps, so
+  count streams for a season take seconds.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _METER_H
+#define _METER_H
+
+#include <stdint.h>
+
+struct meter {
+
+  /**
+    RC oscillator. Without tuning, its frequency is off F_CPU by a random
+    walk with a standard deviation of wander and a time constant of
+    wander_time, temperature and supply changes of the device. One step of
+    OSCCAL changes it by osccal_step. Above twice the tolerated deviation,
+    osctune.h keeps hunting.
+
+    Units: 1, s, 1
+  */
+  double wander;
+  double wander_time;
+  double osccal_step;
+
+  /**
+    USB interrupt. It runs for sof_cycles at the start of each frame, and
+    for packet_cycles on each of traffic packets per second, at random
+    times.
+
+    Units: CPU cycles, 1/s
+  */
+  double sof_cycles;
+  double packet_cycles;
+  double traffic;
+
+  /**
+    Comparator. latch_cycles from trigger to reading Timer 1, about 28 for
+    the C version of ISR(ANA_COMP_vect), 8 for ASM_COMPARATOR_ISR. Its
+    input offset is fixed, noise is gaussian with this standard deviation,
+    supply ripple included.
+
+    Units: CPU cycles, V, V
+  */
+  double latch_cycles;
+  double offset;
+  double noise;
+
+  /**
+    State. drift is the untuned clock error, osccal the tuning steps taken,
+    clock the resulting error, all relative to F_CPU. time of the last
+    charge in seconds. delayed counts charges the USB interrupt delayed,
+    steps OSCCAL changes during charges.
+  */
+  double drift;
+  int32_t osccal;
+  double clock;
+  double time;
+  uint32_t delayed;
+  uint32_t steps;
+};
+
+extern struct meter meter;
+
+/**
+  Set parameters to defaults, tune the clock in and register the charge
+  hook in hal_plant. Sensor temperatures come from plant.h then.
+*/
+void meter_init(void);
+
+/**
+  Timer 1 ticks of a charge starting at time seconds, for a thermistor at
+  temperature celsius. bandgap as for hal_plant.charge. Returns 0 for a
+  comparator that never triggers. Times of consecutive calls must not
+  decrease.
+*/
+uint32_t meter_ticks(double celsius, uint8_t bandgap, double time);
+
+#endif /* _METER_H */
@@ -0,0 +1,286 @@
+/** \file plant.c
+
+  Thermal plant for the host build, see plant.h.
+
+  Integration is explicit Euler in steps of at most PLANT_STEP, which is
+  well below the shortest time constant, a radiator at a few minutes. The
+  sensor lag is integrated exactly. Hooks only accumulate time, integration
+  happens when the firmware starts a measurement or a motor runs, because
+  that's when the state matters. This keeps a simulated season at seconds.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "plant.h"
+#include "hal_sim.h"
+
+/**
+  Longest integration step.
+
+  Unit:  microseconds
+*/
+#define PLANT_STEP 10000000UL
+
+#define KELVIN 273.15
+
+struct plant plant;
+
+
+/* ---- Random numbers ---------------------------------------------------- */
+
+/**
+  xorshift64*, small, fast and good enough for weather and noise.
+*/
+static uint64_t random_next(void) {
+
+  plant.random ^= plant.random >> 12;
+  plant.random ^= plant.random << 25;
+  plant.random ^= plant.random >> 27;
+  return plant.random * 0x2545F4914F6CDD1DULL;
+}
+
+double plant_uniform(void) {
+  return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double plant_gauss(void) {
+  double u = plant_uniform();
+
+  // Box-Muller, one of the two results is enough.
+  return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * plant_uniform());
+}
+
+
+/* ---- Sensors ----------------------------------------------------------- */
+
+/**
+  Charge time through the thermistor until the comparator triggers:
+  t = R * C * ln(Vcc / (Vcc - Vref)).
+*/
+static double charge_factor(uint8_t bandgap) {
+  double reference = bandgap ? plant.bandgap : plant.reference;
+
+  return plant.capacitor * log(plant.supply / (plant.supply - reference)) *
+         (HAL_TICKS_PER_MS * 1000.0);
+}
+
+double plant_ohms(double celsius) {
+  return plant.thermistor_r25 *
+         exp(plant.thermistor_beta *
+             (1.0 / (celsius + KELVIN) - 1.0 / (25.0 + KELVIN)));
+}
+
+double plant_ticks(double celsius, uint8_t bandgap) {
+  return plant_ohms(celsius) * charge_factor(bandgap);
+}
+
+double plant_celsius(double ticks) {
+  double r = ticks / charge_factor(0);
+
+  return 1.0 / (1.0 / (25.0 + KELVIN) +
+                log(r / plant.thermistor_r25) / plant.thermistor_beta) -
+         KELVIN;
+}
+
+double plant_sensor(uint8_t sensor) {
+
+  plant_update();
+  switch (sensor) {
+    case HAL_SENSOR_C2:
+      return plant.sensor[1];
+    case HAL_SENSOR_V:
+      return plant.radiator[0];
+    case HAL_SENSOR_R:
+      return plant.room;
+    default:
+      return plant.sensor[0];
+  }
+}
+
+static uint32_t plant_charge(uint8_t sensor, uint8_t bandgap) {
+  double ticks;
+
+  ticks = plant_ticks(plant_sensor(sensor), bandgap) +
+          plant.noise * plant_gauss();
+  return ticks < 1.0 ? 1 : (uint32_t)(ticks + 0.5);
+}
+
+
+/* ---- Thermal model ----------------------------------------------------- */
+
+static double outdoor_at(double time) {
+  double hour = fmod(time / 3600.0, 24.0);
+
+  return plant.outdoor_mean + plant.outdoor_offset + plant.front -
+         plant.outdoor_daily * cos(2.0 * M_PI * (hour - 5.0) / 24.0);
+}
+
+/**
+  Advance the model by dt seconds.
+*/
+static void integrate(double dt) {
+  double supply, excess, heat, room_heat = 0.0;
+  double lag = 1.0 - exp(-dt / plant.sensor_time);
+  uint8_t v;
+
+  plant.time += dt;
+  if (plant.front_time > 0.0) {
+    plant.front += -plant.front * dt / plant.front_time +
+                   plant.outdoor_front * sqrt(2.0 * dt / plant.front_time) *
+                   plant_gauss();
+  }
+  plant.outdoor = outdoor_at(plant.time);
+
+  supply = plant.supply_base + plant.supply_slope * (20.0 - plant.outdoor);
+  if (supply > plant.supply_max) {
+    supply = plant.supply_max;
+  }
+
+  for (v = 0; v < plant.radiators; v++) {
+    excess = plant.radiator[v] - plant.room;
+    heat = excess > 0.0 ?
+           plant.radiator_power * pow(excess / 50.0, 1.3) :
+           plant.radiator_power * excess / 50.0;
+    plant.radiator[v] += (plant.valve[v] * plant.flow *
+                          (supply - plant.radiator[v]) - heat) *
+                         dt / plant.radiator_capacity;
+    room_heat += heat;
+
+    plant.sensor[v] += (plant.radiator[v] - plant.sensor[v]) * lag;
+
+    if (plant.radiator[v] > plant.ista_start && excess > plant.ista_delta) {
+      plant.ista[v] += excess * dt / 3600.0;
+    }
+  }
+
+  plant.room += (room_heat + plant.gain -
+                 (plant.loss + (plant.window_open ? plant.window : 0.0)) *
+                 (plant.room - plant.outdoor)) * dt / plant.room_capacity;
+}
+
+void plant_update(void) {
+  uint32_t step;
+
+  while (plant.pending_us) {
+    step = plant.pending_us < PLANT_STEP ? plant.pending_us : PLANT_STEP;
+    integrate(step / 1e6);
+    plant.pending_us -= step;
+  }
+}
+
+/**
+  Valves move while their motor runs, up to the end stop.
+*/
+static void plant_advance(uint32_t us, const int8_t motor[2]) {
+  double ms = us / 1000.0;
+  uint8_t v;
+
+  for (v = 0; v < PLANT_VALVES; v++) {
+    if (motor[v] && motor[v] != plant.motor_last[v]) {
+      plant.motor_moves[v]++;
+    }
+    plant.motor_last[v] = motor[v];
+    if ( ! motor[v]) {
+      continue;
+    }
+
+    plant_update();
+    plant.motor_ms[v] += ms;
+    if (motor[v] > 0) {
+      plant.valve[v] += ms / plant.stroke_open;
+      if (plant.valve[v] > 1.0) {
+        plant.valve[v] = 1.0;
+      }
+    }
+    else {
+      plant.valve[v] -= ms / plant.stroke_close;
+      if (plant.valve[v] < 0.0) {
+        plant.valve[v] = 0.0;
+      }
+    }
+  }
+
+  // PLANT_STEP keeps this far from overflowing, as measurements call
+  // plant_update() about every second.
+  plant.pending_us += us;
+  if (plant.pending_us >= PLANT_STEP) {
+    plant_update();
+  }
+}
+
+
+/* ---- Setup ------------------------------------------------------------- */
+
+void plant_init(uint64_t seed) {
+  uint8_t v;
+
+  memset(&plant, 0, sizeof(plant));
+
+  plant.outdoor_mean = 0.0;
+  plant.outdoor_daily = 4.0;
+  plant.outdoor_front = 3.0;
+  plant.front_time = 2.0 * 86400.0;
+
+  plant.supply_base = 35.0;
+  plant.supply_slope = 1.0;
+  plant.supply_max = 70.0;
+
+  plant.radiators = 1;
+  plant.radiator_power = 2500.0;
+  plant.radiator_capacity = 80000.0;
+  plant.flow = 300.0;
+  plant.stroke_open = 2000.0;
+  plant.stroke_close = 4000.0;
+
+  plant.room_capacity = 3.0e6;
+  plant.loss = 60.0;
+  plant.window = 200.0;
+  plant.gain = 150.0;
+
+  // A 33 kOhm NTC puts the default TARGET_TEMPERATURE at about 44 C.
+  plant.sensor_time = 120.0;
+  plant.thermistor_r25 = 33000.0;
+  plant.thermistor_beta = 3950.0;
+  plant.capacitor = 1.0e-6;
+  plant.supply = 5.0;
+  plant.reference = 1.08;
+  plant.bandgap = 1.1;
+  plant.noise = 20.0;
+
+  plant.ista_start = 25.0;
+  plant.ista_delta = 4.5;
+
+  // Zero would keep xorshift at zero forever.
+  plant.random = seed ^ 0x9E3779B97F4A7C15ULL;
+  if ( ! plant.random) {
+    plant.random = 1;
+  }
+
+  // Warm room, cold radiators, closed valves.
+  plant.outdoor = outdoor_at(0.0);
+  plant.room = 20.0;
+  for (v = 0; v < PLANT_VALVES; v++) {
+    plant.radiator[v] = plant.room;
+    plant.sensor[v] = plant.room;
+  }
+
+  hal_plant.charge = plant_charge;
+  hal_plant.advance = plant_advance;
+}
@@ -0,0 +1,187 @@
+/** \file plant.h
+
+  Thermal plant for the host build: radiators with their valves, the ISTA
+  counter sensors on them, the room they heat and the weather outside. Hooks
+  into hal_sim.h, so the regulator in main.c runs in a closed loop against
+  it.
+
+  All state and parameters live in the global struct plant. plant_init()
+  sets defaults, callers may change any parameter afterwards, also while
+  the simulation runs. Randomness (weather fronts, sensor noise) comes from
+  a generator seeded in plant_init(), so a run is fully deterministic given
+  the seed and the parameters.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PLANT_H
+#define _PLANT_H
+
+#include <stdint.h>
+
+#define PLANT_VALVES 2
+
+struct plant {
+
+  /**
+    Weather. Outdoor temperature is outdoor_mean plus outdoor_offset, minus
+    a daily swing of outdoor_daily (coldest at 5:00), plus weather fronts,
+    a random walk with a standard deviation of outdoor_front and a time
+    constant of front_time.
+
+    Units: degrees Celsius, seconds
+  */
+  double outdoor_mean;
+  double outdoor_offset;
+  double outdoor_daily;
+  double outdoor_front;
+  double front_time;
+
+  /**
+    Heating. Flow temperature follows a heating curve: supply_base at 20 C
+    outdoor, plus supply_slope per degree colder, at most supply_max.
+
+    Units: degrees Celsius, K/K
+  */
+  double supply_base;
+  double supply_slope;
+  double supply_max;
+
+  /**
+    Radiators. radiators is how many there are, 1 or 2, each with its own
+    valve and ISTA counter. Heat output is radiator_power at 50 K above
+    room temperature, with the usual exponent of 1.3. Water flow through a
+    fully open valve is flow, in W/K.
+
+    Valves travel from closed to open in stroke_open milliseconds of motor
+    run time, back in stroke_close. Flow is linear to valve position.
+
+    Units: 1, W, W/K, J/K, ms
+  */
+  uint8_t radiators;
+  double radiator_power;
+  double radiator_capacity;
+  double flow;
+  double stroke_open;
+  double stroke_close;
+
+  /**
+    Room. Heat loss to outside is loss, plus window while a window is open,
+    gain is internal heat from people and appliances.
+
+    Units: J/K, W/K, W
+  */
+  double room_capacity;
+  double loss;
+  double window;
+  uint8_t window_open;
+  double gain;
+
+  /**
+    ISTA counter sensor, attached to the radiator surface with a first
+    order lag of sensor_time. Charge time of the capacitor is calculated
+    from an NTC thermistor (thermistor_r25 at 25 C, thermistor_beta), the
+    capacitor, supply and comparator reference voltage, plus gaussian
+    noise with a standard deviation of noise.
+
+    The sensor on the valve body (SENSOR_V) reads the radiator directly,
+    the room sensor (SENSOR_R) the room.
+
+    Units: s, Ohm, K, F, V, V, Timer 1 ticks
+  */
+  double sensor_time;
+  double thermistor_r25;
+  double thermistor_beta;
+  double capacitor;
+  double supply;
+  double reference;
+  double bandgap;
+  double noise;
+
+  /**
+    Consumption as an electronic ISTA counter would record it: the
+    radiator's excess temperature over the room, integrated over time
+    while the radiator is above ista_start and at least ista_delta above
+    the room.
+
+    Units: degrees Celsius, K
+  */
+  double ista_start;
+  double ista_delta;
+
+  /**
+    State. Temperatures in degrees Celsius, valve position 0 (closed) to 1
+    (open), ista in Kh, motor run time in ms, time in seconds.
+  */
+  double time;
+  double outdoor;
+  double front;
+  double room;
+  double radiator[PLANT_VALVES];
+  double sensor[PLANT_VALVES];
+  double valve[PLANT_VALVES];
+  double ista[PLANT_VALVES];
+  double motor_ms[PLANT_VALVES];
+  uint32_t motor_moves[PLANT_VALVES];
+  int8_t motor_last[PLANT_VALVES];
+  uint32_t pending_us;
+  uint64_t random;
+};
+
+extern struct plant plant;
+
+/**
+  Set parameters to defaults, start all temperatures at equilibrium with
+  the valve closed and register the hooks in hal_plant.
+*/
+void plant_init(uint64_t seed);
+
+/**
+  Bring the state up to the current simulated time. Hooks do this lazily,
+  call it before reading state.
+*/
+void plant_update(void);
+
+/**
+  Temperature at a sensor, HAL_SENSOR_*. Brings the state up to date.
+*/
+double plant_sensor(uint8_t sensor);
+
+/**
+  Thermistor resistance at temperature celsius, in Ohm.
+*/
+double plant_ohms(double celsius);
+
+/**
+  Timer 1 ticks for a thermistor at temperature celsius, without noise.
+  bandgap as for hal_plant.charge.
+*/
+double plant_ticks(double celsius, uint8_t bandgap);
+
+/**
+  Sensor temperature for a reading, the inverse of plant_ticks().
+*/
+double plant_celsius(double ticks);
+
+/**
+  Random numbers from the plant's generator. Uniform in [0, 1) and gaussian
+  with a standard deviation of 1.
+*/
+double plant_uniform(void);
+double plant_gauss(void);
+
+#endif /* _PLANT_H */
@@ -0,0 +1,301 @@
+/** \file replay.c
+
+  Replay of recorded terminal.py output through the firmware. Recorded
+  readings become the sensor's raw counts, so the firmware's smoothing and
+  regulation run on them just like on the device. After each recorded line
+  the firmware gets polled like terminal.py does. Then its answer, the
+  candidate, is written next to the recorded one, the deployed one.
+
+  Usage: ./replay [-n noise] [-s seed] [-d] [file]
+
+    -n  Noise added to the recorded readings, in Timer 1 ticks, default 0.
+    -s  Seed for this noise.
+    -d  Write only lines where candidate and deployed decisions differ,
+        both known.
+
+  Without file, the trace comes from stdin, so compressed logs can be piped
+  in. Input is read line by line and nothing is kept, so log size doesn't
+  matter. Lines terminal.py writes besides readings are skipped.
+
+  Output is CSV, one line per recorded reading and valve:
+
+  count:     terminal.py's line number.
+  valve:     0 or 1.
+  reading:   recorded reading.
+  filtered:  what the candidate regulated on, its answer to the poll.
+  deployed:  recorded decision, '+' opened, '-' closed, ' ' held. '?' if
+             terminal.py didn't print it, which it does for readings equal
+             to the previous one.
+  candidate: the candidate's decision, same characters. '?' if it didn't
+             regulate since the previous line.
+
+  Decisions are compared only where both regulated between the same two
+  lines. The deployed firmware's regulation steps show in the recording only
+  as movements, so at each newly reported one the candidate's steps get
+  aligned to the middle of this poll interval, by shifting simulated time
+  against recorded time. Before the first one, candidate decisions are '?'.
+  Same regulation period on both sides assumed, so candidate and deployed
+  regulate between the same lines also when holding.
+
+  A summary goes to stderr.
+
+  To replay with a candidate algorithm, build it with other FEATURES or
+  calibration values, e.g. 'make FEATURES=-DPREDICTION_STEEPNESS=2'.
+
+  Recorded readings are already smoothed by the deployed firmware and
+  sampled once a minute only, so the candidate sees them lagging one more
+  filter. Regulation doesn't mind, it looks at minutes, too.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+
+/**
+  terminal.py polls every 60 seconds. Taken when a line's clock time
+  doesn't give a sensible interval.
+*/
+#define REPLAY_INTERVAL 60
+
+static uint16_t reading[2];
+
+/**
+  Candidate's regulation steps, see hal_state: the last count seen, the
+  simulated time of the last step and the interval since the one before.
+*/
+static uint16_t regulations;
+static uint64_t regulated_us, period_us;
+
+/**
+  Decisions per valve: [deployed][candidate], index into DECISIONS.
+*/
+#define DECISIONS " +-?"
+
+static uint32_t decisions[2][4][4];
+
+
+static uint32_t charge(uint8_t sensor, uint8_t bandgap) {
+  double ticks = reading[sensor == HAL_SENSOR_C2 ? 1 : 0];
+
+  // A measurement starts the main loop pass after the regulation step.
+  if (*hal_state.regulations != regulations) {
+    regulations = *hal_state.regulations;
+    if (regulated_us) {
+      period_us = hal_time_us - regulated_us;
+    }
+    regulated_us = hal_time_us;
+  }
+
+  // Supply compensation sees a stable supply.
+  (void)bandgap;
+  ticks += plant.noise * plant_gauss();
+  return ticks < 1.0 ? 1 : (uint32_t)(ticks + 0.5);
+}
+
+/**
+  Valve text of terminal.py, see ISTAtrolPort.do().
+*/
+static char deployed_decision(const char *text, const char *opened,
+                              const char *closed, uint8_t known) {
+  if (strstr(text, opened)) {
+    return '+';
+  }
+  if (strstr(text, closed)) {
+    return '-';
+  }
+  return known ? ' ' : '?';
+}
+
+static uint8_t decision_index(char decision) {
+  const char *at = strchr(DECISIONS, decision);
+
+  return at && decision ? at - DECISIONS : 0;
+}
+
+int main(int argc, char *argv[]) {
+  char line[256], *valve2, deployed[2], deployed_last[2] = { ' ', ' ' };
+  char candidate[2];
+  uint32_t count, hours, minutes, seconds, clock, clock_last = 0;
+  uint32_t lines = 0, differences = 0, previous = 0, r2, interval;
+  uint64_t seed = 1, now = 0, polled_us = 0, period;
+  int64_t offset_us = 0, delta, until;
+  uint8_t answer[6], valves, seen = 1, v, d, c, only_differences = 0, known;
+  uint8_t aligned = 0, fresh, moved;
+  double noise = 0.0;
+  FILE *in = stdin;
+  int opt, len, dual;
+
+  while ((opt = getopt(argc, argv, "n:s:d")) != -1) {
+    switch (opt) {
+      case 'n': noise = atof(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'd': only_differences = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-n noise] [-s seed] [-d] [file]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc && ! (in = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  plant_init(seed);
+  plant.noise = noise;
+  hal_plant.charge = charge;
+  hal_plant.advance = NULL;
+
+  printf("count,valve,reading,filtered,deployed,candidate\n");
+
+  while (fgets(line, sizeof(line), in)) {
+    len = strlen(line);
+    if (len && line[len - 1] != '\n' && ! feof(in)) {
+      // Not a reading, that's much shorter. Skip the rest.
+      while (fgets(line, sizeof(line), in) && line[strlen(line) - 1] != '\n')
+        ;
+      continue;
+    }
+
+    // "%5d\t%5d\t%2.1f°C\t%s%s", time as %X, see ISTAtrolPort.do().
+    if (sscanf(line, "%u\t%hu\t%*f°C\t%u:%u:%u", &count, &reading[0],
+               &hours, &minutes, &seconds) != 5) {
+      continue;
+    }
+    // DUAL_VALVE readings follow after a fourth tab.
+    valve2 = line;
+    for (v = 0; valve2 && v < 4; v++) {
+      valve2 = strchr(valve2 + (v > 0), '\t');
+    }
+    dual = valve2 && sscanf(valve2, "\t%u", &r2) == 1;
+    if (valve2) {
+      *valve2++ = '\0';
+    }
+    reading[1] = dual ? r2 : reading[0];
+
+    clock = (hours * 60 + minutes) * 60 + seconds;
+    interval = REPLAY_INTERVAL;
+    if (lines) {
+      // Clock time wraps at midnight.
+      interval = clock > clock_last ? clock - clock_last :
+                 clock < clock_last ? clock + 86400 - clock_last :
+                 REPLAY_INTERVAL;
+      now += interval;
+    }
+    clock_last = clock;
+    lines++;
+
+    until = (int64_t)now * 1000000 + offset_us;
+    hal_run(until > 0 ? until : 0);
+    valves = dual ? 2 : 1;
+    if (valves > seen) {
+      seen = valves;
+    }
+    len = hal_usb_request('c', 0, 0, answer, 3 * valves);
+    fresh = regulated_us > polled_us;
+    polled_us = hal_time_us;
+
+    // terminal.py prints decisions only if the first reading changed.
+    known = reading[0] != previous;
+    deployed[0] = deployed_decision(line, "(Valve opened)", "(Valve closed)",
+                                    known);
+    deployed[1] = deployed_decision(dual ? valve2 : "", "(Valve 2 opened)",
+                                    "(Valve 2 closed)", known);
+
+    // A movement not reported on the previous line is a regulation step
+    // since then. Move the candidate's steps to the middle of the interval,
+    // by the shortest shift. Takes effect from the next line on.
+    moved = 0;
+    for (v = 0; v < valves; v++) {
+      if ((deployed[v] == '+' || deployed[v] == '-') &&
+          deployed[v] != deployed_last[v]) {
+        moved = 1;
+      }
+    }
+    if (moved && regulated_us) {
+      period = period_us ? period_us :
+               (hal_calibration.radiator_response_time + 1) * 1000000ULL;
+      delta = ((int64_t)regulated_us -
+               ((int64_t)now * 1000000 - interval * 500000LL + offset_us)) %
+              (int64_t)period;
+      if (delta >= (int64_t)period / 2) {
+        delta -= period;
+      }
+      else if (delta < -(int64_t)period / 2) {
+        delta += period;
+      }
+      offset_us += delta;
+      if ( ! aligned) {
+        // Steps so far weren't aligned, this line's neither.
+        aligned = 1;
+        fresh = 0;
+      }
+    }
+    for (v = 0; v < 2; v++) {
+      if (deployed[v] != '?') {
+        deployed_last[v] = deployed[v];
+      }
+    }
+
+    for (v = 0; v < valves; v++) {
+      candidate[v] = len >= 3 * (v + 1) && aligned && fresh ?
+                     answer[3 * v + 2] : '?';
+      d = decision_index(deployed[v]);
+      c = decision_index(candidate[v]);
+      decisions[v][d][c]++;
+      if (d != 3 && c != 3 && c != d) {
+        differences++;
+      }
+      else if (only_differences) {
+        continue;
+      }
+      printf("%u,%u,%u,", count, v, reading[v]);
+      if (len >= 3 * (v + 1)) {
+        printf("%u", answer[3 * v] | (answer[3 * v + 1] << 8));
+      }
+      printf(",%c,%c\n", deployed[v], candidate[v]);
+    }
+    previous = reading[0];
+  }
+
+  if (in != stdin) {
+    fclose(in);
+  }
+
+  fprintf(stderr, "%u readings over %.1f days, %u decisions differ.\n",
+          lines, now / 86400.0, differences);
+  for (v = 0; v < seen; v++) {
+    fprintf(stderr, "valve %u, deployed down, candidate across:\n"
+                    "       hold   open  close      ?\n", v);
+    for (d = 0; d < 4; d++) {
+      fprintf(stderr, "%5s", d == 0 ? "hold" : d == 1 ? "open" :
+                             d == 2 ? "close" : "?");
+      for (c = 0; c < 4; c++) {
+        fprintf(stderr, " %6u", decisions[v][d][c]);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return 0;
+}
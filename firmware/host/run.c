@@ -0,0 +1,96 @@
+/** \file run.c
+
+  Smoke test for the host build: run the firmware against a sensor reading
+  a fixed number of Timer 1 ticks, then report what it did.
+
+  Usage: ./run [hours [ticks]]
+
+  Defaults are one simulated day at 6000 ticks, which is a bit above the
+  default TARGET_TEMPERATURE, so colder. Nothing warms up, so the valve
+  should open a step every RADIATOR_RESPONSE_TIME and never close.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hal_sim.h"
+
+
+static uint32_t ticks = 6000;
+static uint64_t motor_us[2][2];  // [valve][open, close]
+static uint32_t moves[2][2];
+static int8_t motor_last[2];
+
+static uint32_t charge(uint8_t sensor, uint8_t bandgap) {
+
+  (void)sensor;
+  (void)bandgap;
+  return ticks;
+}
+
+static void advance(uint32_t us, const int8_t motor[2]) {
+  uint8_t v;
+
+  for (v = 0; v < 2; v++) {
+    if (motor[v] && motor[v] != motor_last[v]) {
+      moves[v][motor[v] < 0]++;
+    }
+    if (motor[v]) {
+      motor_us[v][motor[v] < 0] += us;
+    }
+    motor_last[v] = motor[v];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t hours = 24, hour;
+  uint8_t answer[3];
+  int len;
+  clock_t start;
+
+  if (argc > 1) {
+    hours = strtoull(argv[1], NULL, 0);
+  }
+  if (argc > 2) {
+    ticks = strtoul(argv[2], NULL, 0);
+  }
+
+  hal_plant.charge = charge;
+  hal_plant.advance = advance;
+
+  start = clock();
+  for (hour = 1; hour <= hours; hour++) {
+    hal_run(hour * 3600000000ULL);
+    len = hal_usb_request('c', 0, 0, answer, sizeof(answer));
+    if (len < 3) {
+      printf("hour %3llu: no answer\n", (unsigned long long)hour);
+      continue;
+    }
+    printf("hour %3llu: reading %5u, moved '%c', "
+           "opened %u times / %llu ms, closed %u times / %llu ms\n",
+           (unsigned long long)hour, answer[0] | (answer[1] << 8), answer[2],
+           moves[0][0], (unsigned long long)(motor_us[0][0] / 1000),
+           moves[0][1], (unsigned long long)(motor_us[0][1] / 1000));
+  }
+  printf("%llu simulated hours in %.2f seconds.\n", (unsigned long long)hours,
+         (double)(clock() - start) / CLOCKS_PER_SEC);
+
+  return 0;
+}
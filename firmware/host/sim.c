@@ -0,0 +1,106 @@
+/** \file sim.c
+
+  Closed loop simulation: the firmware regulating the plant in plant.c.
+  Writes a CSV line every interval, one column set per radiator.
+
+  Usage: ./sim [-s seed] [-d days] [-i interval] [-t outdoor] [-n noise]
+               [-r radiators] [-m]
+
+    -s  Seed for weather and sensor noise. Same seed, same run.
+    -d  Simulated days, default 7.
+    -i  Seconds between CSV lines, default 600.
+    -t  Mean outdoor temperature in C, default 0.
+    -n  Sensor noise in Timer 1 ticks, default 20.
+    -r  Radiators, 2 needs a firmware built with DUAL_VALVE.
+    -m  Readings from the measurement model in meter.h instead of gaussian
+        noise, -n doesn't apply then.
+
+  reading is what the firmware reports with request 'c', sensor the
+  temperature the plant has at this sensor, ista the modeled consumption.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+#include "meter.h"
+
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 1, interval = 600, end, t;
+  double days = 7.0, outdoor = 0.0, noise = 20.0;
+  uint8_t radiators = 1, model = 0, answer[6], v;
+  int opt, len;
+
+  while ((opt = getopt(argc, argv, "s:d:i:t:n:r:m")) != -1) {
+    switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'd': days = atof(optarg); break;
+      case 'i': interval = strtoull(optarg, NULL, 0); break;
+      case 't': outdoor = atof(optarg); break;
+      case 'n': noise = atof(optarg); break;
+      case 'r': radiators = atoi(optarg); break;
+      case 'm': model = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [-d days] [-i interval] "
+                        "[-t outdoor] [-n noise] [-r radiators] [-m]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (radiators < 1 || radiators > PLANT_VALVES || interval < 1) {
+    fprintf(stderr, "Invalid radiators or interval.\n");
+    return 1;
+  }
+
+  plant_init(seed);
+  plant.outdoor_mean = outdoor;
+  plant.noise = noise;
+  plant.radiators = radiators;
+  if (model) {
+    meter_init();
+  }
+
+  printf("hours,outdoor,room");
+  for (v = 0; v < radiators; v++) {
+    printf(",valve%u,radiator%u,sensor%u,reading%u,ista%u", v, v, v, v, v);
+  }
+  printf("\n");
+
+  end = (uint64_t)(days * 86400.0);
+  for (t = interval; t <= end; t += interval) {
+    hal_run(t * 1000000ULL);
+    len = hal_usb_request('c', 0, 0, answer, 3 * radiators);
+    plant_update();
+
+    printf("%.3f,%.2f,%.2f", plant.time / 3600.0, plant.outdoor, plant.room);
+    for (v = 0; v < radiators; v++) {
+      printf(",%.3f,%.2f,%.2f,", plant.valve[v], plant.radiator[v],
+             plant.sensor[v]);
+      if (len >= 3 * (v + 1)) {
+        printf("%u", answer[3 * v] | (answer[3 * v + 1] << 8));
+      }
+      printf(",%.2f", plant.ista[v]);
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,590 @@
+/** \file sweep.c
+
+  Parameter sweep of the calibration values in main.c. Builds the firmware
+  for each combination of values, runs evaluate.c on it for a number of
+  seeds and writes the averaged figures as CSV, ranked into Pareto fronts
+  of comfort (cold) against consumption (ista) against valve wear
+  (motor_ms).
+
+  Usage: ./sweep [-j jobs] [-n seeds] [-d days] [-t outdoor] [-c comfort]
+                 [-b builddir] [-p NAME=values ...]
+
+    -j  Parallel jobs, default all cores.
+    -n  Seeds per combination, default 2.
+    -d  Simulated days per seed, default 7.
+    -t  Mean outdoor temperature in C, default 0.
+    -c  Room temperature considered comfortable in C, default 20.
+    -b  BUILDDIR of the Makefile, default build.
+    -p  Values of one calibration value, overriding its default from
+        parameters[]. Either a list, like 'MOT_OPEN_TIME=100,200,400', or a
+        range, like 'TARGET_TEMPERATURE=5400:6200:100'. A single value
+        keeps it fixed.
+
+  Run it in firmware/host, best with 'make sweep', as it builds the
+  variants with this Makefile, into variants/ of its BUILDDIR. FEATURES
+  given to make apply to the variants, too. Each build is evaluated, then
+  removed again.
+
+  Each combination is built and evaluated in processes of its own, because
+  the firmware can't be compiled with other calibration values at runtime
+  and runs only once per process, see hal_sim.h. Evaluations of the same
+  build run in parallel. Worker threads take jobs from the bottom of their
+  own deque; when it's empty, they steal from the top of other deques, so
+  the seeds of a fresh build spread over idle cores.
+
+  front is 1 for combinations no other combination beats in all three
+  figures, 2 for those only beaten by front 1, and so on. 0 means the
+  build or an evaluation failed.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// For pipe2().
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/**
+  Calibration values to sweep, with the default grid. Names are those of
+  main.c, values in main.c's units.
+*/
+#define PARAMETERS 6
+#define MAX_VALUES 64
+
+static struct parameter {
+  const char *name;
+  uint8_t count;
+  long value[MAX_VALUES];
+} parameters[PARAMETERS] = {
+  { "TARGET_TEMPERATURE",     5, { 5400, 5600, 5800, 6000, 6200 } },
+  { "THERMISTOR_HYSTERESIS",  3, { 25, 50, 100 } },
+  { "RADIATOR_RESPONSE_TIME", 3, { 60, 120, 240 } },
+  { "PREDICTION_STEEPNESS",   4, { 1, 2, 4, 8 } },
+  { "MOT_OPEN_TIME",          3, { 100, 200, 400 } },
+  { "MOT_CLOSE_TIME",         3, { 200, 400, 800 } },
+};
+
+/**
+  Figures per combination, summed over seeds. See evaluate.c.
+*/
+#define FIGURES 5
+
+static struct result {
+  double figure[FIGURES];
+  uint32_t done;
+  uint8_t failed;
+  uint32_t front;
+} *results;
+
+static uint32_t combinations, seeds = 2;
+static const char *days = "7", *outdoor = "0", *comfort = "20";
+static const char *builddir = "build";
+
+
+/* ---- Work stealing pool ------------------------------------------------ */
+
+/**
+  A job is combination * (seeds + 1) + step. Step 0 builds, steps 1 to
+  seeds evaluate with that seed.
+*/
+struct deque {
+  pthread_mutex_t lock;
+  uint32_t *job;
+  uint32_t size, top, bottom;
+};
+
+static struct deque *deques;
+static uint32_t workers;
+
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t outstanding, finished;
+
+static void deque_push(struct deque *d, uint32_t job) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->size) {
+    memmove(d->job, d->job + d->top, (d->bottom - d->top) * sizeof(uint32_t));
+    d->bottom -= d->top;
+    d->top = 0;
+    if (d->bottom == d->size) {
+      d->size = d->size ? d->size * 2 : 64;
+      d->job = realloc(d->job, d->size * sizeof(uint32_t));
+      if ( ! d->job) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+  }
+  d->job[d->bottom++] = job;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/**
+  Own deque: newest job first, that's the one with the build still hot.
+*/
+static int deque_pop(struct deque *d, uint32_t *job) {
+  int found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top) {
+    *job = d->job[--d->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+/**
+  Other deques: oldest job first, to take over the bulk of the work.
+*/
+static int deque_steal(struct deque *d, uint32_t *job) {
+  int found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top) {
+    *job = d->job[d->top++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+
+/* ---- Jobs -------------------------------------------------------------- */
+
+static void variant_dir(char *dir, size_t size, uint32_t combination) {
+  snprintf(dir, size, "%s/variants/%u", builddir, combination);
+}
+
+static long parameter_value(uint32_t combination, uint8_t p) {
+  uint8_t i;
+
+  for (i = PARAMETERS - 1; i > p; i--) {
+    combination /= parameters[i].count;
+  }
+  return parameters[p].value[combination % parameters[p].count];
+}
+
+/**
+  Run a program, wait for it, return its exit status, -1 if it didn't exit
+  normally. With output, its stdout goes there, up to size bytes.
+*/
+static int run(char *const argv[], char *output, size_t size) {
+  posix_spawn_file_actions_t actions;
+  int pipefd[2] = { -1, -1 }, status;
+  size_t len = 0;
+  ssize_t got;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&actions);
+  if (output) {
+    // Close-on-exec, so children other threads spawn don't inherit it.
+    if (pipe2(pipefd, O_CLOEXEC)) {
+      perror("pipe");
+      return -1;
+    }
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+  }
+  status = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (output) {
+    close(pipefd[1]);
+    if ( ! status) {
+      while (len + 1 < size &&
+             (got = read(pipefd[0], output + len, size - 1 - len)) > 0) {
+        len += got;
+      }
+    }
+    output[len] = '\0';
+    close(pipefd[0]);
+  }
+  if (status) {
+    fprintf(stderr, "Can't run %s: %s\n", argv[0], strerror(status));
+    return -1;
+  }
+
+  if (waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+static int job_build(uint32_t combination) {
+  char dir[PATH_MAX], build[PATH_MAX + 16], variant[PATH_MAX + 16];
+  char calibration[512];
+  char *argv[] = { "make", "-s", "--no-print-directory", build, variant,
+                   calibration, "variant", NULL };
+  size_t len;
+  uint8_t p;
+
+  variant_dir(dir, sizeof(dir), combination);
+  snprintf(build, sizeof(build), "BUILDDIR=%s", builddir);
+  snprintf(variant, sizeof(variant), "VARIANT=%s", dir);
+  len = snprintf(calibration, sizeof(calibration), "CALIBRATION=");
+  for (p = 0; p < PARAMETERS; p++) {
+    len += snprintf(calibration + len, sizeof(calibration) - len, "%s-D%s=%ld",
+                    p ? " " : "", parameters[p].name,
+                    parameter_value(combination, p));
+  }
+
+  return run(argv, NULL, 0);
+}
+
+static int job_evaluate(uint32_t combination, uint32_t seed,
+                        double figure[FIGURES]) {
+  char program[PATH_MAX], seedarg[16], output[256];
+  char *argv[] = { program, "-s", seedarg, "-d", (char *)days,
+                   "-t", (char *)outdoor, "-c", (char *)comfort, NULL };
+
+  variant_dir(program, sizeof(program) - 10, combination);
+  strcat(program, "/evaluate");
+  snprintf(seedarg, sizeof(seedarg), "%u", seed);
+
+  if (run(argv, output, sizeof(output)) ||
+      sscanf(output, "%lf,%lf,%lf,%lf,%lf", &figure[0], &figure[1],
+             &figure[2], &figure[3], &figure[4]) != FIGURES) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+  The build isn't needed any longer after its last evaluation.
+*/
+static void job_cleanup(uint32_t combination) {
+  char dir[PATH_MAX], file[PATH_MAX + 16];
+
+  variant_dir(dir, sizeof(dir), combination);
+  snprintf(file, sizeof(file), "%s/evaluate", dir);
+  unlink(file);
+  snprintf(file, sizeof(file), "%s/firmware.o", dir);
+  unlink(file);
+  rmdir(dir);
+}
+
+static void job_run(struct deque *own, uint32_t job) {
+  uint32_t combination = job / (seeds + 1), step = job % (seeds + 1), s;
+  struct result *r = &results[combination];
+  double figure[FIGURES];
+  int failed, last, i;
+
+  if (step == 0) {
+    failed = job_build(combination);
+    pthread_mutex_lock(&results_lock);
+    if (failed) {
+      r->failed = 1;
+      outstanding -= seeds;
+      finished++;
+    }
+    pthread_mutex_unlock(&results_lock);
+    if (failed) {
+      fprintf(stderr, "Building combination %u failed.\n", combination);
+      job_cleanup(combination);
+    }
+    else {
+      for (s = seeds; s >= 1; s--) {
+        deque_push(own, job + s);
+      }
+    }
+  }
+  else {
+    failed = job_evaluate(combination, step, figure);
+    pthread_mutex_lock(&results_lock);
+    if (failed) {
+      r->failed = 1;
+    }
+    else {
+      for (i = 0; i < FIGURES; i++) {
+        r->figure[i] += figure[i];
+      }
+    }
+    last = ++r->done == seeds;
+    if (last && ++finished % 100 == 0) {
+      fprintf(stderr, "%u of %u combinations done.\n", finished,
+              combinations);
+    }
+    pthread_mutex_unlock(&results_lock);
+    if (last) {
+      job_cleanup(combination);
+    }
+  }
+
+  pthread_mutex_lock(&results_lock);
+  outstanding--;
+  pthread_mutex_unlock(&results_lock);
+}
+
+static void *worker(void *arg) {
+  uint32_t self = (uintptr_t)arg, victim, job, left, i;
+  int found;
+
+  for (;;) {
+    found = deque_pop(&deques[self], &job);
+    for (i = 1; ! found && i < workers; i++) {
+      victim = (self + i) % workers;
+      found = deque_steal(&deques[victim], &job);
+    }
+    if (found) {
+      job_run(&deques[self], job);
+      continue;
+    }
+
+    pthread_mutex_lock(&results_lock);
+    left = outstanding;
+    pthread_mutex_unlock(&results_lock);
+    if ( ! left) {
+      break;
+    }
+    // Jobs still running may push more, wait for them.
+    usleep(10000);
+  }
+
+  return NULL;
+}
+
+
+/* ---- Pareto fronts ----------------------------------------------------- */
+
+/**
+  Objectives, indices into figure[]: cold, ista, motor_ms.
+*/
+static const uint8_t objective[] = { 0, 1, 3 };
+
+#define OBJECTIVES (sizeof(objective) / sizeof(objective[0]))
+
+static int dominates(const struct result *a, const struct result *b) {
+  uint8_t i, better = 0;
+
+  for (i = 0; i < OBJECTIVES; i++) {
+    if (a->figure[objective[i]] > b->figure[objective[i]]) {
+      return 0;
+    }
+    if (a->figure[objective[i]] < b->figure[objective[i]]) {
+      better = 1;
+    }
+  }
+  return better;
+}
+
+/**
+  Peel off non-dominated combinations front by front. Quadratic per front,
+  which is nothing compared to simulating them.
+*/
+static void rank_fronts(void) {
+  uint32_t front, ranked = 0, valid = 0, i, j;
+
+  for (i = 0; i < combinations; i++) {
+    if ( ! results[i].failed) {
+      valid++;
+    }
+  }
+
+  for (front = 1; ranked < valid; front++) {
+    for (i = 0; i < combinations; i++) {
+      if (results[i].failed || results[i].front) {
+        continue;
+      }
+      for (j = 0; j < combinations; j++) {
+        if (j != i && ! results[j].failed &&
+            ( ! results[j].front || results[j].front == front) &&
+            dominates(&results[j], &results[i])) {
+          break;
+        }
+      }
+      if (j == combinations) {
+        results[i].front = front;
+      }
+    }
+    for (i = 0; i < combinations; i++) {
+      if (results[i].front == front) {
+        ranked++;
+      }
+    }
+  }
+}
+
+
+/* ---- Setup ------------------------------------------------------------- */
+
+/**
+  Parse 'NAME=a,b,c' or 'NAME=from:to:step' into parameters[].
+*/
+static int parse_values(const char *arg) {
+  struct parameter *p = NULL;
+  const char *values = strchr(arg, '=');
+  long from, to, step;
+  char *end;
+  uint8_t i;
+
+  for (i = 0; values && i < PARAMETERS; i++) {
+    if (strlen(parameters[i].name) == (size_t)(values - arg) &&
+        ! strncmp(arg, parameters[i].name, values - arg)) {
+      p = &parameters[i];
+    }
+  }
+  if ( ! p) {
+    fprintf(stderr, "Unknown calibration value in %s.\n", arg);
+    return -1;
+  }
+  values++;
+
+  p->count = 0;
+  if (sscanf(values, "%ld:%ld:%ld", &from, &to, &step) == 3) {
+    if (step <= 0 || to < from) {
+      fprintf(stderr, "Invalid range in %s.\n", arg);
+      return -1;
+    }
+    for ( ; from <= to; from += step) {
+      if (p->count == MAX_VALUES) {
+        fprintf(stderr, "More than %u values in %s.\n", MAX_VALUES, arg);
+        return -1;
+      }
+      p->value[p->count++] = from;
+    }
+    return 0;
+  }
+
+  do {
+    if (p->count == MAX_VALUES) {
+      fprintf(stderr, "More than %u values in %s.\n", MAX_VALUES, arg);
+      return -1;
+    }
+    p->value[p->count++] = strtol(values, &end, 0);
+    if (end == values || (*end && *end != ',')) {
+      fprintf(stderr, "Invalid value list in %s.\n", arg);
+      return -1;
+    }
+    values = end + 1;
+  } while (*end);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char dir[PATH_MAX];
+  pthread_t *threads;
+  uint32_t i, jobs = 0;
+  int opt, p, f;
+
+  while ((opt = getopt(argc, argv, "j:n:d:t:c:b:p:")) != -1) {
+    switch (opt) {
+      case 'j': jobs = atoi(optarg); break;
+      case 'n': seeds = atoi(optarg); break;
+      case 'd': days = optarg; break;
+      case 't': outdoor = optarg; break;
+      case 'c': comfort = optarg; break;
+      case 'b': builddir = optarg; break;
+      case 'p':
+        if (parse_values(optarg)) {
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-j jobs] [-n seeds] [-d days] "
+                        "[-t outdoor] [-c comfort] [-b builddir] "
+                        "[-p NAME=values ...]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (seeds < 1) {
+    fprintf(stderr, "Need at least one seed.\n");
+    return 1;
+  }
+  if (jobs < 1) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  combinations = 1;
+  for (p = 0; p < PARAMETERS; p++) {
+    combinations *= parameters[p].count;
+  }
+  fprintf(stderr, "Sweeping %u combinations, %u seeds each, %u jobs.\n",
+          combinations, seeds, jobs);
+
+  results = calloc(combinations, sizeof(struct result));
+  workers = jobs;
+  deques = calloc(workers, sizeof(struct deque));
+  threads = calloc(workers, sizeof(pthread_t));
+  if ( ! results || ! deques || ! threads) {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < workers; i++) {
+    pthread_mutex_init(&deques[i].lock, NULL);
+  }
+
+  // Builds dealt out round robin, newest on the bottom, so the first jobs
+  // taken are those of the first combinations.
+  outstanding = combinations * (seeds + 1);
+  for (i = combinations; i-- > 0; ) {
+    deque_push(&deques[i % workers], i * (seeds + 1));
+  }
+
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)i)) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  for (i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  snprintf(dir, sizeof(dir), "%s/variants", builddir);
+  rmdir(dir);
+
+  for (i = 0; i < combinations; i++) {
+    for (f = 0; f < FIGURES; f++) {
+      results[i].figure[f] /= seeds;
+    }
+  }
+  rank_fronts();
+
+  for (p = 0; p < PARAMETERS; p++) {
+    printf("%s,", parameters[p].name);
+  }
+  printf("cold,ista,moves,motor_ms,room_mean,front\n");
+  for (i = 0; i < combinations; i++) {
+    for (p = 0; p < PARAMETERS; p++) {
+      printf("%ld,", parameter_value(i, p));
+    }
+    if (results[i].failed) {
+      printf(",,,,,0\n");
+      continue;
+    }
+    printf("%.3f,%.2f,%.1f,%.0f,%.2f,%u\n", results[i].figure[0],
+           results[i].figure[1], results[i].figure[2], results[i].figure[3],
+           results[i].figure[4], results[i].front);
+  }
+
+  return 0;
+}
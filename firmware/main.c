@@ -21,13 +21,8 @@
 */
 
 #include <string.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/wdt.h>
-#include <util/delay.h>
 
-#include "usbdrv.h"
+#include "hal.h"
 #include "pinio.h"
 
 
@@ -57,7 +52,9 @@
   Unit:  1
   Range: 500..32267
 */
-#define TARGET_TEMPERATURE 5800
+#ifndef TARGET_TEMPERATURE
+  #define TARGET_TEMPERATURE 5800
+#endif
 
 /** \def THERMISTOR_HYSTERESIS
 
@@ -72,7 +69,9 @@
   Unit:  1
   Range: 0..499
 */
-#define THERMISTOR_HYSTERESIS 50
+#ifndef THERMISTOR_HYSTERESIS
+  #define THERMISTOR_HYSTERESIS 50
+#endif
 
 /** \def RADIATOR_RESPONSE_TIME
 
@@ -88,7 +87,9 @@
   Unit:  seconds (approximately)
   Range: 0..65535
 */
-#define RADIATOR_RESPONSE_TIME 120
+#ifndef RADIATOR_RESPONSE_TIME
+  #define RADIATOR_RESPONSE_TIME 120
+#endif
 
 /** \def PREDICTION_STEEPNESS
 
@@ -100,7 +101,9 @@
   Unit:  1
   Range: 1, 2, 4, 8 or 16 (must be exponent 2 to keep the binary small)
 */
-#define PREDICTION_STEEPNESS 4
+#ifndef PREDICTION_STEEPNESS
+  #define PREDICTION_STEEPNESS 4
+#endif
 
 /** \def MOT_OPEN_TIME
 
@@ -112,7 +115,9 @@
   Unit:  milliseconds
   Range: 1..6500
 */
-#define MOT_OPEN_TIME 200
+#ifndef MOT_OPEN_TIME
+  #define MOT_OPEN_TIME 200
+#endif
 
 /** \def MOT_CLOSE_TIME
 
@@ -123,11 +128,615 @@
   Unit:  milliseconds
   Range: 1..6500
 */
-#define MOT_CLOSE_TIME 400
+#ifndef MOT_CLOSE_TIME
+  #define MOT_CLOSE_TIME 400
+#endif
+
+#ifdef HOST_BUILD
+/**
+  Calibration values as compiled, for simulations, see host/hal_sim.h.
+*/
+const struct hal_calibration hal_calibration = {
+  TARGET_TEMPERATURE, THERMISTOR_HYSTERESIS, RADIATOR_RESPONSE_TIME,
+  PREDICTION_STEEPNESS, MOT_OPEN_TIME, MOT_CLOSE_TIME
+};
+#endif
 
 /* ---- End calibration values -------------------------------------------- */
 
 
+/* ---- Start optional features ------------------------------------------- */
+
+/**
+  About optional features in general.
+
+  Nothing of this fits into the ATtiny2313 together with the USB driver
+  without dropping something else, so all of them are off by default. They're
+  switched on by FEATURES in the Makefile, not here, because some of them
+  also affect usbconfig.h or assembly files.
+*/
+
+/** \def DUAL_VALVE
+
+  Drive a second radiator from the same controller. Adds a second valve motor
+  and a second ISTA counter sensor on spare pins (see pinio.h) and runs an
+  independent regulator for each radiator.
+
+  Both motors are fed from the same supply, which is limited by
+  USB_CFG_MAX_BUS_POWER, so they never run at the same time. Regulators only
+  request a movement, motor_schedule() runs at most one of them per main loop
+  pass.
+*/
+#ifdef DUAL_VALVE
+  #define NUM_VALVES 2
+#else
+  #define NUM_VALVES 1
+#endif
+
+/**
+  Approximate duration of a main loop pass. Each valve's sensor takes a
+  poll_a_second(), except with TEMP_ADC. Counters of passes meant to be
+  seconds count in steps of this, so each valve sees the same timing with
+  DUAL_VALVE.
+
+  Unit: seconds
+*/
+#ifdef TEMP_ADC
+  #define PASS_SECONDS 1
+#else
+  #define PASS_SECONDS NUM_VALVES
+#endif
+
+/** \def EXTERNAL_SENSOR
+
+  Accept temperature readings from the host, e.g. from a wall sensor read
+  elsewhere, as a virtual ISTA counter sensor. The host sends vendor request
+  'e' (valve 0) or 'f' (valve 1) with the reading in wValue, same unit as
+  TARGET_TEMPERATURE, and a validity timeout in wIndex.
+
+  While valid, the regulator uses this reading instead of temp_c. When the
+  host stops sending, the reading goes stale and the regulator falls back to
+  the local sensor.
+
+  Timeout unit:  seconds (approximately), counted per main loop pass, see
+                 PASS_SECONDS.
+*/
+
+/** \def ASM_COMPARATOR_ISR
+
+  Use the hand written assembly version of ISR(ANA_COMP_vect) in anacomp.S.
+  It latches Timer 1 some 20 cycles earlier, blocks the USB interrupt for
+  much shorter and is a few bytes smaller. See there for details.
+*/
+
+/** \def DECISION_TRACE
+
+  Keep a small ring of records explaining the last regulation decisions, see
+  struct trace_record. The host downloads the whole ring with vendor request
+  't', terminal.py --trace decodes it.
+
+  Costs sizeof(struct trace_record) bytes of RAM per entry.
+*/
+#ifndef TRACE_LENGTH
+  #define TRACE_LENGTH 4
+#endif
+
+/** \def SUPPLY_COMPENSATION
+
+  Scale motor run times with the supply voltage, so a valve movement travels
+  the same distance on 5 V USB as on a sagging or higher external supply.
+
+  Thermistor measurements are ratiometric, charge time doesn't depend on
+  supply voltage, because the comparator reference is a divider of the same
+  supply. Measuring the same sensor a second time against the internal
+  bandgap reference instead (ACBG) gives a charge time which gets longer with
+  lower supply voltage. The ratio of both is independent of thermistor and
+  capacitor and is roughly proportional to 1 / supply voltage, just like the
+  time a DC motor needs for a given travel. See supply_measure().
+
+  The bandgap can replace AIN0 only. On the ISTAtrol v0.1 board, AIN0 is the
+  capacitor, so this feature needs a board with pins 12 and 13 swapped:
+  reference divider on AIN0, capacitor on AIN1.
+
+  Vendor request 's' returns the measured ratio, supply_scale.
+*/
+
+/** \def SUPPLY_SCALE_NOMINAL
+
+  supply_scale as measured with the supply voltage MOT_OPEN_TIME and
+  MOT_CLOSE_TIME were calibrated with. Calculated value for 5 V and 1.08 V
+  on AIN0 is 261, the bandgap's tolerance (1.0 to 1.2 V) makes this vary
+  from chip to chip, so better read it from the device.
+
+  Unit:  1/256
+  Range: 128..1024
+*/
+#ifndef SUPPLY_SCALE_NOMINAL
+  #define SUPPLY_SCALE_NOMINAL 261
+#endif
+
+/** \def MOTOR_SOFT_START
+
+  Drive the valve motor with hardware PWM on OC1A/OC1B instead of switching
+  it straight on and off. Duty cycle ramps up over MOT_RAMP_UP_TIME and down
+  over MOT_RAMP_DOWN_TIME, which avoids the inrush current spike disturbing
+  the supply shared by MCU, comparator reference and USB transceiver.
+
+  Timer 1 is needed for this, so it's borrowed from temperature measurements
+  for the duration of a movement. Motor run times include the ramps, which
+  move the valve about half as far as full drive would, so MOT_OPEN_TIME and
+  MOT_CLOSE_TIME may need an increase by half the ramp times.
+
+  The second valve of DUAL_VALVE isn't on PWM pins and keeps full drive.
+*/
+
+/** \def MOT_RAMP_UP_TIME
+
+  Time to ramp motor drive from zero to full.
+
+  Unit:  milliseconds
+  Range: 1..255
+*/
+#ifndef MOT_RAMP_UP_TIME
+  #define MOT_RAMP_UP_TIME 50
+#endif
+
+/** \def MOT_RAMP_DOWN_TIME
+
+  Time to ramp motor drive from full back to zero.
+
+  Unit:  milliseconds
+  Range: 1..255
+*/
+#ifndef MOT_RAMP_DOWN_TIME
+  #define MOT_RAMP_DOWN_TIME 30
+#endif
+
+/** \def MOTOR_NOISE_STATS
+
+  Count Analog Comparator triggers while a motor runs. The capacitor rests
+  discharged then, so each of them is noise injected by the motor. Vendor
+  request 'n' returns the number of motor movements and of these triggers,
+  for comparing drive methods, e.g. with and without MOTOR_SOFT_START.
+
+  This is a proxy only: it counts rising comparator edges, not how far noise
+  got, and nothing here counts USB errors. Those show up as failed transfers
+  in terminal.py, to be counted on the host. No before and after numbers
+  have been taken yet, compare 'n' of both builds after the same number of
+  movements.
+
+  Needs the C version of ISR(ANA_COMP_vect).
+*/
+#if defined MOTOR_NOISE_STATS && defined ASM_COMPARATOR_ISR
+  #error MOTOR_NOISE_STATS requires the C version of ISR(ANA_COMP_vect).
+#endif
+
+/** \def RESOURCE_ARBITER
+
+  Keep motor runs and measurements from disturbing each other and USB. A
+  running motor disturbs the supply and the comparator reference, and would
+  leave USB unserviced for hundreds of milliseconds.
+
+  Motors and measurements never overlap, as both run from the main loop
+  only. So this does blanking and retries, no locking: a measurement waits
+  out MOTOR_BLANKING_TIME after each motor movement, and gets repeated up to
+  TEMP_RETRIES times if the comparator didn't trigger. Such samples are
+  dropped instead of being fed into the moving average. Motor runs poll USB
+  every few milliseconds.
+*/
+
+/** \def MOTOR_BLANKING_TIME
+
+  Time to let supply and reference settle after a motor movement before the
+  next measurement starts.
+
+  Unit:  milliseconds, rounded to multiples of 40
+  Range: 0..10000
+*/
+#ifndef MOTOR_BLANKING_TIME
+  #define MOTOR_BLANKING_TIME 200
+#endif
+
+/** \def TEMP_RETRIES
+
+  How often a measurement without comparator trigger gets repeated before
+  giving up, see RESOURCE_ARBITER. Giving up leaves the reading of the
+  previous measurement in place.
+
+  Unit:  1
+  Range: 0..254
+*/
+#ifndef TEMP_RETRIES
+  #define TEMP_RETRIES 2
+#endif
+
+/** \def FRAME_SYNC
+
+  Start measurements of sensor C in a USB frame set by the host, so all
+  devices on one host measure in the same frame. Host snapshots of a whole
+  fleet are then aligned without interpolation.
+
+  V-USB detects SOF packets, but doesn't decode their frame number. The
+  firmware counts SOFs (USB_COUNT_SOF) and the host tells which frame number
+  "now" is, along with the wanted phase, using the 'y' request:
+
+    wValue: the host's frame number at the time of sending.
+    wIndex: phase, frame number modulo FRAME_SYNC_PERIOD to measure at.
+
+  Setup latency of this request is a frame or two, the same for all devices
+  on the bus. Hosts without access to the frame number can send any common
+  millisecond clock instead, see terminal.py --sync. Request 'Y' returns the
+  device's notion of the current frame and the frame of the last measurement
+  start, 2 bytes each.
+
+  Until the first 'y' request, measurements run free as without this feature.
+  As a synchronized measurement waits for its frame, one pass of the main
+  loop takes FRAME_SYNC_PERIOD milliseconds, also for RADIATOR_RESPONSE_TIME.
+
+  Requires RESOURCE_ARBITER, because only with it motor runs poll USB often
+  enough to not miss SOF counter overflows.
+*/
+#ifdef FRAME_SYNC
+  #ifndef RESOURCE_ARBITER
+    #error FRAME_SYNC requires RESOURCE_ARBITER.
+  #endif
+#endif
+
+/** \def FRAME_SYNC_PERIOD
+
+  Measurement period with FRAME_SYNC. Power of two, else alignment breaks
+  when USB frame numbers wrap at 2048. Must be longer than one pass of
+  temp_measure(), about 1000 ms per sensor.
+
+  Unit:  USB frames, milliseconds
+  Range: 1024, 2048
+*/
+#ifndef FRAME_SYNC_PERIOD
+  #define FRAME_SYNC_PERIOD 2048
+#endif
+
+/** \def ALARMS
+
+  Evaluate alarm conditions after each measurement and push changes at once
+  through an interrupt-IN endpoint (USB_CFG_HAVE_INTRIN_ENDPOINT), so a host
+  learns about them without polling. See alarm_check() for the conditions.
+
+  An event is sent whenever the set of active alarms of a valve changes, 4
+  bytes: valve number, active alarm bits (ALARM_BIT_*), temp_c of this valve.
+
+  Limits default to the values below and can be changed at runtime with
+  request 'a': wIndex selects the limit (0: ALARM_FROST, 1: ALARM_RATE,
+  2: ALARM_STUCK_MOVES, 3: ALARM_SENSOR_MIN), wValue is the new value.
+*/
+
+/** \def ALARM_FROST
+
+  Filtered reading above which (colder than) the frost alarm triggers.
+
+  Unit:  ADC reading, see TARGET_TEMPERATURE
+  Range: 0..65535
+*/
+#ifndef ALARM_FROST
+  #define ALARM_FROST 8400  // About 5 °C
+#endif
+
+/** \def ALARM_RATE
+
+  Warming rate per measurement at which the room heating up although the
+  valve was closed last triggers an alarm.
+
+  Unit:  ADC reading per main loop pass
+  Range: 1..1000
+*/
+#ifndef ALARM_RATE
+  #define ALARM_RATE 13  // About 0.1 °C
+#endif
+
+/** \def ALARM_STUCK_MOVES
+
+  Number of motor movements into the same direction after which the valve is
+  considered stuck. A full stroke takes about 10 movements.
+
+  Unit:  1
+  Range: 1..255
+*/
+#ifndef ALARM_STUCK_MOVES
+  #define ALARM_STUCK_MOVES 20
+#endif
+
+/** \def ALARM_SENSOR_MIN
+
+  Raw readings below this are a sensor fault: shorted thermistor, or the
+  comparator not triggering at all, which leaves a reading of zero.
+
+  Unit:  ADC reading
+  Range: 0..65535
+*/
+#ifndef ALARM_SENSOR_MIN
+  #define ALARM_SENSOR_MIN 1000  // About 63 °C
+#endif
+
+/** \def MOVE_PLAN
+
+  Accept a list of planned valve movements and execute it on the firmware's
+  own clock, so a plan survives host stalls and USB hiccups. The clock counts
+  main loop passes, about a second each per sensor, starting with zero when
+  the plan gets started. Entries must be sent in time order:
+
+  - Request 'P' with wValue = 0 stops a running plan and clears the list.
+  - Request 'p' appends an entry. wValue: time offset. wIndex: run time in
+    milliseconds in bits 0..13, bit 14 set for the second valve, bit 15 set
+    for opening. A run time of zero makes a checkpoint without movement.
+  - Request 'q' sets the expected reading at the time of the last appended
+    entry. Zero, the default, means no expectation.
+  - Request 'P' with wValue != 0 starts the plan, wValue being the allowed
+    deviation from expected readings.
+
+  Before executing an entry with an expectation, the filtered reading is
+  compared to it. Exceeding the deviation aborts the plan. Regulation pauses
+  while a plan runs.
+
+  While a planned movement runs, USB gets polled, but 'P', 'p' and 'q' are
+  ignored, as they'd change the plan under plan_run()'s feet. Hosts check
+  the result with 'Q' and repeat.
+
+  Request 'Q' returns plan state (PLAN_*), index of the next entry and the
+  plan clock, 4 bytes.
+*/
+
+/** \def PLAN_LENGTH
+
+  Number of entries a move plan can have, see MOVE_PLAN. Costs 6 bytes RAM
+  each.
+
+  Unit:  1
+  Range: 1..16
+*/
+#ifndef PLAN_LENGTH
+  #define PLAN_LENGTH 6
+#endif
+
+/** \def RAW_CAPTURE
+
+  Keep a ring of the latest raw readings per valve, as they go into
+  temp_filter(), with the uptime they were taken at. The host reads all
+  rings in one transfer with vendor request 'r', terminal.py --raw prints
+  them. Meant to stay enabled in production builds, so alternative filters
+  can be evaluated on field data.
+
+  Costs 4 bytes RAM per entry and valve.
+*/
+#ifndef RAW_LENGTH
+  #define RAW_LENGTH 4
+#endif
+
+/** \def TEMP_ADC
+
+  Measure thermistors with the ADC instead of Analog Comparator and Timer 1.
+  Needs an MCU with ADC supported by V-USB, e.g. an ATmega328P (set MCU in
+  the Makefile). The rest of the firmware is unchanged: temp_sample() still
+  delivers a reading in temp_temp, higher readings still mean colder.
+
+  Each sensor is a voltage divider, powered from its TEMP_* pin while
+  measuring: fixed resistor from the pin to the ADC input, thermistor from
+  there to ground. ADC reference is AVCC, which also feeds the pins, so the
+  reading is ratiometric and independent of supply voltage. Inputs are ADC0
+  to ADC3 (PC0 to PC3), numbered like SENSOR_*.
+
+  Each reading is 64 conversions, summed and scaled to 0..8184, which gives
+  about 13 bits of resolution. Choosing the fixed resistor at about 0.4 times
+  the thermistor resistance at room temperature gives readings similar to the
+  comparator method, so TARGET_TEMPERATURE needs little recalibration. A
+  reading takes about 8 ms, all sensors well below 50 ms. Discharge times are
+  gone, one pass of the main loop takes one poll_a_second() regardless of the
+  number of sensors.
+
+  Not compatible with the comparator specific ASM_COMPARATOR_ISR,
+  SUPPLY_COMPENSATION and MOTOR_NOISE_STATS. Neither with MOTOR_SOFT_START,
+  because on ATmega328P OC1A and OC1B aren't on the motor pins.
+*/
+#ifdef TEMP_ADC
+  #ifndef ADCSRA
+    #error TEMP_ADC requires an MCU with ADC, e.g. atmega328p.
+  #endif
+  #if defined ASM_COMPARATOR_ISR || defined SUPPLY_COMPENSATION || \
+      defined MOTOR_NOISE_STATS || defined MOTOR_SOFT_START
+    #error TEMP_ADC is incompatible with some features, see its description.
+  #endif
+#endif
+
+/** \def ADC_SLEEP_MODE
+
+  Sleep mode for conversions with TEMP_ADC. Idle stops the CPU clock only,
+  the edge on INT0 starting a USB packet wakes it, so USB stays serviced.
+
+  ADC Noise Reduction, SLEEP_MODE_ADC, would also stop the I/O clock and
+  give less noise. But then only a level interrupt on INT0 wakes the chip,
+  not the edge V-USB uses, so the device ignores USB for the whole
+  measurement. Only for devices without USB traffic meanwhile.
+*/
+#ifndef ADC_SLEEP_MODE
+  #define ADC_SLEEP_MODE SLEEP_MODE_IDLE
+#endif
+
+/** \def MEASURE_NOW
+
+  Vendor request 'm' measures the sensor given in wIndex (SENSOR_*) right
+  away and returns 5 bytes: status, the fresh raw reading and the filtered
+  reading this raw reading would result in, 2 bytes each. Regular
+  measurements stay undisturbed, neither their results nor their filter
+  state change.
+
+  The comparator method needs the capacitor discharged, so this works in
+  the time window between about 120 ms after a regular charge and 120 ms
+  before the next one, only. Outside this window, and during motor runs,
+  status is 1 and the host should try again a bit later. Status 2 means the
+  comparator didn't trigger. The answer comes about 10 ms after the request.
+  With TEMP_ADC, the same window applies for simplicity.
+*/
+
+/** \def ADAPTIVE_HORIZON
+
+  Let each valve find its own prediction horizon instead of using the fixed
+  PREDICTION_STEEPNESS, which is just the starting value then. After each
+  valve movement, the next one tells how well the prediction worked:
+
+  - Overshoot: the reading went from one side of the hysteresis corridor to
+    the other. Reaction came too late, the horizon grows by 1/8.
+  - Undershoot: the valve gets moved back while the reading never left the
+    side it was on when moving. Reaction came too early, the horizon shrinks
+    by 1/8.
+
+  The horizon is fixed point with 4 fractional bits, limited to
+  HORIZON_MIN..HORIZON_MAX. Request 'h' returns it, 2 bytes per valve. Costs
+  a multiplication, so some more Flash than the shift of a power of two.
+*/
+
+/** \def HORIZON_MIN
+
+  Limits for ADAPTIVE_HORIZON, same unit as PREDICTION_STEEPNESS.
+
+  Unit:  1
+  Range: 1..HORIZON_MAX
+*/
+#ifndef HORIZON_MIN
+  #define HORIZON_MIN 1
+#endif
+
+/** \def HORIZON_MAX
+
+  See HORIZON_MIN.
+
+  Unit:  1
+  Range: HORIZON_MIN..64
+*/
+#ifndef HORIZON_MAX
+  #define HORIZON_MAX 16
+#endif
+
+/** \def RIPPLE_COUNT
+
+  Count commutation current ripples of the valve motor while it runs and
+  stop a movement after a set number of ripples, which is actual motor
+  travel, independent of supply voltage, temperature and load. Needs the
+  ripple sense stage described at RIPPLE_PIN in pinio.h.
+
+  Ripple counts for opening and closing start as RIPPLE_OPEN and
+  RIPPLE_CLOSE, request 'w' sets them at runtime (wValue: open, wIndex:
+  close). Zero means running by time as without this feature. With ripples
+  set, MOT_OPEN_TIME and MOT_CLOSE_TIME doubled serve as timeout, e.g. for a
+  blocked motor. Planned movements (MOVE_PLAN) always run by time.
+
+  Request 'W' returns counted travel per valve (ripples, opening positive),
+  2 bytes each, followed by the ripple count of the last movement, 2 bytes.
+
+  Not compatible with MOTOR_SOFT_START, PWM edges would count as ripples.
+  Pin change registers are the ATtiny2313 ones.
+*/
+#if defined RIPPLE_COUNT && defined MOTOR_SOFT_START
+  #error RIPPLE_COUNT and MOTOR_SOFT_START are mutually exclusive.
+#endif
+
+/** \def RIPPLE_OPEN
+
+  Ripples per open movement with RIPPLE_COUNT, 0 for running by time. Start
+  with the count reported for a MOT_OPEN_TIME movement.
+
+  Unit:  ripples
+  Range: 0..65535
+*/
+#ifndef RIPPLE_OPEN
+  #define RIPPLE_OPEN 0
+#endif
+
+/** \def RIPPLE_CLOSE
+
+  Same as RIPPLE_OPEN, for closing.
+
+  Unit:  ripples
+  Range: 0..65535
+*/
+#ifndef RIPPLE_CLOSE
+  #define RIPPLE_CLOSE 0
+#endif
+
+/** \def HEAT_DEMAND
+
+  Compute how much heat this controller wants, 0..255, and put it out as PWM
+  on DEMAND_PIN, see pinio.h. Central heating plant can modulate on this.
+  Request 'd' returns the same value, followed by the estimated valve
+  position of each valve, 1 byte each.
+
+  Demand of a valve is made of its position, up to 192 when fully open, plus
+  up to 63 for the room being colder than TARGET_TEMPERATURE, one per
+  DEMAND_ERROR_STEP readings. With more than one valve, the highest demand
+  counts.
+
+  Valve position is estimated by counting movements, so it's zero (closed)
+  at startup and gets right after the valve moved to an end once. Timer 0
+  runs fast PWM with TOP 0xFF, which counts just like normal mode, so
+  osctune.h is unaffected. PWM frequency is about 780 Hz.
+*/
+
+/** \def DEMAND_STROKE
+
+  Valve movements from fully closed to fully open, for HEAT_DEMAND.
+
+  Unit:  1
+  Range: 1..255
+*/
+#ifndef DEMAND_STROKE
+  #define DEMAND_STROKE 10
+#endif
+
+/** \def DEMAND_ERROR_STEP
+
+  Readings below target temperature per step of demand, see HEAT_DEMAND.
+
+  Unit:  ADC reading
+  Range: 1..1000
+*/
+#ifndef DEMAND_ERROR_STEP
+  #define DEMAND_ERROR_STEP 8
+#endif
+
+/** \def HOST_BUILD
+
+  Not a feature, but set by host/Makefile instead of FEATURES. Compiles this
+  file for the computer running the build, with the chip simulated by
+  host/hal_host.c, see hal.h. Runs regulation much faster than real time,
+  for testing changes without waiting for a radiator.
+
+  int has 32 bits there, 16 on the AVR. Sums which may exceed 16 bits get
+  an explicit (uint16_t) cast, so they wrap on both.
+*/
+
+/** \def TIMING_BUILD
+
+  Not a feature either, set by simavr/Makefile. Keeps regulate() a function
+  of its own instead of inlining it, so simavr/timing can find it and count
+  its cycles. Costs a call and a return.
+*/
+#ifdef TIMING_BUILD
+  #define TIMING_VISIBLE __attribute__((noinline))
+#else
+  #define TIMING_VISIBLE
+#endif
+
+/**
+  Set if usbFunctionSetup() has to look at the request.
+*/
+#if defined EXTERNAL_SENSOR || defined DECISION_TRACE || \
+    defined SUPPLY_COMPENSATION || defined MOTOR_NOISE_STATS || \
+    defined FRAME_SYNC || defined ALARMS || defined MOVE_PLAN || \
+    defined RAW_CAPTURE || defined MEASURE_NOW || defined ADAPTIVE_HORIZON || \
+    defined RIPPLE_COUNT || defined HEAT_DEMAND
+  #define USB_VENDOR_REQUESTS
+#endif
+
+/* ---- End optional features --------------------------------------------- */
+
+
 /**
   Using continuous calibration is much smaller (36 bytes, in osctune.h, vs.
   194 bytes for reset-time calibration, osccal.c) and ensures working USB for
@@ -156,22 +765,45 @@ static union {
 //uint8_t motor_moved = ' '; // See struct answer below.
 
 /**
-  Our last temperature measurements.
+  Our last temperature measurements. One ISTA counter reading per valve.
 */
-static uint16_t temp_c = 0; // Reading used for controlling.
+static uint16_t temp_c[NUM_VALVES]; // Reading used for controlling.
 #ifdef MULTISENSOR_BROKEN
 static uint16_t temp_v = 0;
 static uint16_t temp_r = 0;
 #endif
-static uint16_t temp_temp = 0; // Reading directly from ADC.
+/**
+  Shared with ISR(ANA_COMP_vect), so they can't be static when this ISR is
+  implemented in anacomp.S.
+*/
+#ifdef ASM_COMPARATOR_ISR
+  #define ISR_SHARED
+#else
+  #define ISR_SHARED static
+#endif
+
+ISR_SHARED uint16_t temp_temp = 0; // Reading directly from ADC.
 #if TARGET_TEMPERATURE < 7000
   // We can expect thermistor readings to be always below 8192, so it always
   // fits into 12 bits and we can always keep a multiplication by 8.
   // Initialize to a reasonable value to avoid underflows on the first steps.
-  static uint16_t temp_temp_eight = TARGET_TEMPERATURE * 8L;
+  static uint16_t temp_temp_eight[NUM_VALVES] = {
+    [0 ... NUM_VALVES - 1] = TARGET_TEMPERATURE * 8L
+  };
 #endif
 
-static uint8_t conversion_done = 0;
+ISR_SHARED uint8_t conversion_done = 0;
+
+#ifdef EXTERNAL_SENSOR
+/**
+  The virtual sensor, see EXTERNAL_SENSOR. temp_ext_timeout counts down to
+  zero, zero means the reading is stale. temp_ext_used remembers which source
+  the last regulation step used.
+*/
+static uint16_t temp_ext[NUM_VALVES];
+static uint16_t temp_ext_timeout[NUM_VALVES];
+static uint8_t temp_ext_used[NUM_VALVES];
+#endif
 
 #ifndef CAN_AFFORD_USB_COMMANDS
 /**
@@ -180,15 +812,383 @@ static uint8_t conversion_done = 0;
   this answer.
 
   Regular variables are kept in comments and moved in and out here as needed.
+
+  With DUAL_VALVE, the second valve's pair simply follows the first one.
 */
 static struct {
   uint16_t temp_last;
   uint8_t motor_moved;
-} answer;
+} answer[NUM_VALVES];
+#endif
+
+#if defined DECISION_TRACE || defined RAW_CAPTURE
+/**
+  Time since reset, in main loop passes. Wraps after about 18 hours.
+*/
+static uint16_t uptime;
+#endif
+
+#ifdef RAW_CAPTURE
+/**
+  Raw reading rings, see RAW_CAPTURE. head[v] points to the oldest record of
+  valve v. Layout is shared with terminal.py.
+*/
+static struct {
+  uint8_t head[NUM_VALVES];
+  struct {
+    uint16_t time;
+    uint16_t raw;
+  } record[NUM_VALVES][RAW_LENGTH];
+} raw;
+#endif
+
+#ifdef DECISION_TRACE
+
+/**
+  One regulation decision. Layout is shared with terminal.py.
+
+  Reasons: ' '  prediction inside the hysteresis corridor
+           '-'  prediction too warm, valve closed
+           '+'  prediction too cold, valve opened
+
+  Flags:   bit 0  valve number
+           bit 1  reading came from the external sensor
+*/
+struct trace_record {
+  uint16_t time;        // uptime of the decision
+  uint16_t temp;        // filtered reading used
+  int16_t slope;        // temp minus temp of the previous decision
+  uint16_t temp_future; // extrapolated reading
+  uint16_t pulse;       // motor run time in milliseconds, 0 for none
+  uint8_t reason;
+  uint8_t flags;
+};
+
+/**
+  The ring. head points to the oldest record, which is the next one to be
+  overwritten. Sent to the host as a whole.
+*/
+static struct {
+  uint8_t head;
+  struct trace_record record[TRACE_LENGTH];
+} trace;
+
+/**
+  Claim the next record of the ring, overwriting the oldest one.
+*/
+static struct trace_record *trace_next(void) {
+  struct trace_record *r = &trace.record[trace.head];
+
+  trace.head++;
+  if (trace.head >= TRACE_LENGTH) {
+    trace.head = 0;
+  }
+  r->time = uptime;
+  return r;
+}
+#endif /* DECISION_TRACE */
+
+#ifdef HOST_BUILD
+/**
+  Regulation steps so far, for simulations aligning them to recorded ones.
+*/
+static uint16_t host_regulations;
+
+/**
+  State for simulations comparing runs, see host/hal_sim.h.
+*/
+const struct hal_state hal_state = {
+  NUM_VALVES, temp_c,
+  #ifdef DECISION_TRACE
+  (const uint8_t *)&trace, TRACE_LENGTH,
+  #else
+  NULL, 0,
+  #endif
+  &host_regulations
+};
+#endif
+
+#ifdef FRAME_SYNC
+/**
+  USB frames, see FRAME_SYNC. frame.count extends usbSofCount to 16 bits,
+  adding frame.offset gives the host's frame number.
+*/
+static struct {
+  uint16_t count;
+  uint16_t offset;
+  uint16_t phase;
+  uint16_t sampled;   // Host frame number of the last measurement start.
+  uint8_t sof_last;
+  uint8_t synced;
+} frame;
+#endif
+
+#ifdef ALARMS
+/**
+  Alarm bits, see alarm_check().
+*/
+#define ALARM_BIT_FROST   0x01
+#define ALARM_BIT_RATE    0x02
+#define ALARM_BIT_STUCK   0x04
+#define ALARM_BIT_SENSOR  0x08
+
+/**
+  Alarm limits, see ALARMS. Order matches wIndex of request 'a'.
+*/
+static uint16_t alarm_limit[] = {
+  ALARM_FROST, ALARM_RATE, ALARM_STUCK_MOVES, ALARM_SENSOR_MIN
+};
+
+/**
+  Alarm state per valve. 'dir' and 'moves' track motor movements for the
+  stuck and rate alarms, 'last' is the previous filtered reading.
+*/
+static struct {
+  uint16_t last;
+  uint8_t active;
+  uint8_t dir;
+  uint8_t moves;
+} alarm[NUM_VALVES];
+
+/**
+  Valves with a change in active alarms not yet sent, one bit each.
+*/
+static uint8_t alarm_dirty;
+
+/**
+  Send one pending alarm event, if the interrupt endpoint is free.
+*/
+static void alarm_send(void) {
+  uint8_t v, event[4];
+
+  if ( ! alarm_dirty || ! usbInterruptIsReady()) {
+    return;
+  }
+
+  v = (alarm_dirty & 0x01) ? 0 : 1;
+  alarm_dirty &= ~(1 << v);
+  event[0] = v;
+  event[1] = alarm[v].active;
+  event[2] = temp_c[v] & 0xff;
+  event[3] = temp_c[v] >> 8;
+  usbSetInterrupt(event, sizeof(event));
+}
+#endif /* ALARMS */
+
+/**
+  Service USB. With FRAME_SYNC also account SOFs seen meanwhile, so this must
+  be called at least every 255 ms.
+*/
+static void usb_poll(void) {
+
+  usbPoll();
+#ifdef ALARMS
+  alarm_send();
+#endif
+#ifdef FRAME_SYNC
+  {
+    uint8_t sof = usbSofCount;
+
+    frame.count += (uint8_t)(sof - frame.sof_last);
+    frame.sof_last = sof;
+  }
+#endif
+}
+
+#ifdef RESOURCE_ARBITER
+/**
+  40 ms slices of quiet still needed before the next measurement, see
+  RESOURCE_ARBITER.
+*/
+static uint8_t res_blanking;
+#endif /* RESOURCE_ARBITER */
+
+#ifdef ADAPTIVE_HORIZON
+/**
+  Prediction horizon per valve, see ADAPTIVE_HORIZON. Fixed point, 1/16.
+*/
+static uint16_t horizon[NUM_VALVES] = {
+  [0 ... NUM_VALVES - 1] = PREDICTION_STEEPNESS * 16
+};
+
+/**
+  Direction of the last movement and side of the corridor the reading was
+  on at that time: 1 cold, -1 warm, 0 inside. Per valve.
+*/
+static struct {
+  uint8_t dir;
+  int8_t side;
+} horizon_last[NUM_VALVES];
+#endif
+
+#ifdef HEAT_DEMAND
+/**
+  Heat demand and estimated valve positions, see HEAT_DEMAND. Layout is
+  shared with terminal.py.
+*/
+static struct {
+  uint8_t level;
+  uint8_t pos[NUM_VALVES];
+} demand;
 #endif
 
 /* ---- Valve motor movements --------------------------------------------- */
 
+#ifdef MOVE_PLAN
+/**
+  Run time of the planned movement being executed, replacing MOT_OPEN_TIME
+  or MOT_CLOSE_TIME. Zero while regulation moves.
+*/
+static uint16_t plan_ms;
+
+  #define MOTOR_RUN(ms) (plan_ms ? plan_ms : (ms))
+#else
+  #define MOTOR_RUN(ms) (ms)
+#endif
+
+#ifdef SUPPLY_COMPENSATION
+/**
+  Bandgap charge time relative to reference charge time, see
+  supply_measure(). Starts at nominal, so there's no compensation until the
+  first measurement.
+*/
+static uint16_t supply_scale = SUPPLY_SCALE_NOMINAL;
+
+  #define MOTOR_TIME(ms) \
+    ((uint16_t)((uint32_t)MOTOR_RUN(ms) * supply_scale / SUPPLY_SCALE_NOMINAL))
+#else
+  #define MOTOR_TIME(ms)  MOTOR_RUN(ms)
+#endif
+
+#ifdef RIPPLE_COUNT
+/**
+  Ripple counting, see RIPPLE_COUNT. ripple_count counts rising edges during
+  the current movement, which ends on reaching ripple_target, if not zero.
+*/
+static volatile uint16_t ripple_count;
+static uint16_t ripple_target;
+static uint16_t ripple_set[2] = { RIPPLE_OPEN, RIPPLE_CLOSE };
+static struct {
+  int16_t travel[NUM_VALVES];
+  uint16_t last;
+} ripple;
+
+/**
+  Read ripple_count atomically.
+*/
+static uint16_t ripple_read(void) {
+  uint16_t count;
+
+  cli();
+  count = ripple_count;
+  sei();
+  return count;
+}
+
+/**
+  Count a ripple. Pin change triggers on both edges, so count rising ones.
+  Not blocking interrupts, see "Interrupt latency" in usbdrv.h.
+*/
+ISR(PCINT_vect, ISR_NOBLOCK) {
+
+  if (READ(RIPPLE)) {
+    ripple_count++;
+  }
+}
+#endif /* RIPPLE_COUNT */
+
+#if defined SUPPLY_COMPENSATION || defined RESOURCE_ARBITER || \
+    defined MOVE_PLAN || defined RIPPLE_COUNT
+/**
+  Delay for a run time calculated at runtime. _delay_ms() wants constants.
+  With RESOURCE_ARBITER, keep USB serviced meanwhile. With RIPPLE_COUNT,
+  return early when enough ripples were counted.
+*/
+static void motor_delay(uint16_t ms) {
+
+  #ifdef RIPPLE_COUNT
+  if (ripple_target) {
+    ms *= 2;  // Timeout.
+  }
+  #endif
+  while (ms--) {
+  #ifdef RESOURCE_ARBITER
+    if ((ms & 0x07) == 0) {
+      usb_poll();
+    }
+  #endif
+  #ifdef RIPPLE_COUNT
+    if (ripple_target && ripple_read() >= ripple_target) {
+      break;
+    }
+  #endif
+    _delay_ms(1);
+  }
+}
+
+  #define MOTOR_DELAY(ms) motor_delay(MOTOR_TIME(ms))
+#else
+  #define MOTOR_DELAY(ms) _delay_ms(ms)
+#endif
+
+#ifdef MOTOR_NOISE_STATS
+/**
+  See MOTOR_NOISE_STATS. motor_running tells the comparator interrupt to
+  count.
+*/
+static volatile uint8_t motor_running;
+static struct {
+  uint16_t pulses;
+  uint16_t triggers;
+} motor_noise;
+#endif
+
+#ifdef MOTOR_SOFT_START
+/**
+  Run the motor for ms milliseconds with soft start and soft stop. com
+  connects the output compare pin of the wanted direction, see TCCR1A.
+
+  Fast PWM, 8 bit, no prescaler gives 50 kHz, well above audible range.
+  OCR1A and OCR1B are 16-bit registers sharing TEMP with TCNT1, so they're
+  written with interrupts locked.
+*/
+static void motor_pwm(uint8_t com, uint16_t ms) {
+  uint16_t i;
+  uint8_t duty, down;
+
+  TCCR1A = com | (1 << WGM10);
+  TCCR1B = (1 << WGM12) | (1 << CS10);
+
+  for (i = 0; i < ms; i++) {
+    duty = 255;
+    if (i < MOT_RAMP_UP_TIME) {
+      duty = (i * 255U) / MOT_RAMP_UP_TIME;
+    }
+    if (ms - i <= MOT_RAMP_DOWN_TIME) {
+      down = ((ms - i - 1) * 255U) / MOT_RAMP_DOWN_TIME;
+      if (down < duty) {
+        duty = down;
+      }
+    }
+    cli();
+    OCR1A = duty;
+    OCR1B = duty;
+    sei();
+  #ifdef RESOURCE_ARBITER
+    if ((i & 0x07) == 0) {
+      usb_poll();
+    }
+  #endif
+    _delay_ms(1);
+  }
+
+  // Disconnect OC1A/OC1B, pins fall back to PORTB, which is Low. Then
+  // return Timer 1 to measurement operation, see temp_init().
+  TCCR1A = 0;
+  TCCR1B = (1 << CS11);
+}
+#endif /* MOTOR_SOFT_START */
+
 /**
   Intitialise for motor movements. Nothing special.
 
@@ -206,6 +1206,16 @@ static void motor_init(void) {
   WRITE(MOT_OPEN, 0);
   SET_OUTPUT(MOT_CLOSE);
   WRITE(MOT_CLOSE, 0);
+#ifdef DUAL_VALVE
+  SET_OUTPUT(MOT2_OPEN);
+  WRITE(MOT2_OPEN, 0);
+  SET_OUTPUT(MOT2_CLOSE);
+  WRITE(MOT2_CLOSE, 0);
+#endif
+#ifdef RIPPLE_COUNT
+  SET_INPUT(RIPPLE);
+  PCMSK |= (1 << PCINT6);
+#endif
 }
 
 /**
@@ -215,9 +1225,13 @@ static void motor_init(void) {
 */
 static void motor_open(void) {
 
+#ifdef MOTOR_SOFT_START
+  motor_pwm(1 << COM1A1, MOTOR_TIME(MOT_OPEN_TIME));
+#else
   WRITE(MOT_OPEN, 1);
-  _delay_ms(MOT_OPEN_TIME);
+  MOTOR_DELAY(MOT_OPEN_TIME);
   WRITE(MOT_OPEN, 0);
+#endif
 }
 
 /**
@@ -227,13 +1241,212 @@ static void motor_open(void) {
 */
 static void motor_close(void) {
 
+#ifdef MOTOR_SOFT_START
+  motor_pwm(1 << COM1B1, MOTOR_TIME(MOT_CLOSE_TIME));
+#else
   WRITE(MOT_CLOSE, 1);
-  _delay_ms(MOT_CLOSE_TIME);
+  MOTOR_DELAY(MOT_CLOSE_TIME);
   WRITE(MOT_CLOSE, 0);
+#endif
+}
+
+#ifdef DUAL_VALVE
+/**
+  Same as motor_open() and motor_close(), for the second valve.
+*/
+static void motor2_open(void) {
+
+  WRITE(MOT2_OPEN, 1);
+  MOTOR_DELAY(MOT_OPEN_TIME);
+  WRITE(MOT2_OPEN, 0);
+}
+
+static void motor2_close(void) {
+
+  WRITE(MOT2_CLOSE, 1);
+  MOTOR_DELAY(MOT_CLOSE_TIME);
+  WRITE(MOT2_CLOSE, 0);
+}
+#endif /* DUAL_VALVE */
+
+/**
+  Move valve v in direction dir, '+' for opening, '-' for closing.
+*/
+static void motor_move(uint8_t v, uint8_t dir) {
+
+#ifdef MOTOR_NOISE_STATS
+  motor_noise.pulses++;
+  motor_running = 1;
+#endif
+#ifdef RIPPLE_COUNT
+  cli();
+  ripple_count = 0;
+  sei();
+  ripple_target = ripple_set[dir == '+' ? 0 : 1];
+  #ifdef MOVE_PLAN
+  if (plan_ms) {
+    ripple_target = 0;
+  }
+  #endif
+  EIFR = (1 << PCIF);
+  GIMSK |= (1 << PCIE);
+#endif
+
+#ifdef DUAL_VALVE
+  if (v) {
+    if (dir == '+') motor2_open(); else motor2_close();
+  } else
+#endif
+  if (dir == '+') motor_open(); else motor_close();
+
+#ifdef MOTOR_NOISE_STATS
+  motor_running = 0;
+#endif
+#ifdef HEAT_DEMAND
+  if (dir == '+') {
+    if (demand.pos[v] < DEMAND_STROKE) {
+      demand.pos[v]++;
+    }
+  } else if (demand.pos[v]) {
+    demand.pos[v]--;
+  }
+#endif
+#ifdef RIPPLE_COUNT
+  // Ripples of the coasting motor count, too.
+  _delay_ms(5);
+  GIMSK &= ~(1 << PCIE);
+  ripple.last = ripple_read();
+  if (dir == '+') {
+    ripple.travel[v] += ripple.last;
+  } else {
+    ripple.travel[v] -= ripple.last;
+  }
+#endif
+#ifdef ALARMS
+  if (dir != alarm[v].dir) {
+    alarm[v].dir = dir;
+    alarm[v].moves = 0;
+  }
+  if (alarm[v].moves < 255) {
+    alarm[v].moves++;
+  }
+#endif
+#ifdef RESOURCE_ARBITER
+  res_blanking = MOTOR_BLANKING_TIME / 40;
+#endif
+}
+
+#ifdef DUAL_VALVE
+/**
+  Pending motor movements, one per valve, same values as
+  answer[].motor_moved. Written by the regulators, executed by
+  motor_schedule().
+*/
+static uint8_t motor_request[NUM_VALVES] = {
+  [0 ... NUM_VALVES - 1] = ' '
+};
+
+/**
+  Motor arbiter. Runs at most one requested movement per call, so the two
+  motors are never energized at the same time. Valves take turns, so a valve
+  waiting for its turn gets served on the next main loop pass, PASS_SECONDS
+  later, which is negligible compared to RADIATOR_RESPONSE_TIME.
+*/
+static void motor_schedule(void) {
+  static uint8_t next = 0;
+  uint8_t i, v;
+
+  for (i = 0; i < NUM_VALVES; i++) {
+    v = next;
+    next = (next + 1) % NUM_VALVES;
+
+    if (motor_request[v] != ' ') {
+      motor_move(v, motor_request[v]);
+      answer[v].motor_moved = motor_request[v];
+      motor_request[v] = ' ';
+      break;
+    }
+  }
+}
+#endif /* DUAL_VALVE */
+
+#ifdef MOVE_PLAN
+/**
+  Move plan, see MOVE_PLAN. 'run' of an entry holds run time and flags as
+  sent with request 'p'.
+*/
+#define PLAN_IDLE     0
+#define PLAN_RUNNING  1
+#define PLAN_DONE     2
+#define PLAN_ABORTED  3
+
+#define PLAN_OPEN     0x8000
+#define PLAN_VALVE2   0x4000
+#define PLAN_MS       0x3fff
+
+static struct {
+  uint8_t state;
+  uint8_t next;
+  uint16_t time;
+  uint16_t bound;
+  uint8_t count;
+  struct {
+    uint16_t at;
+    uint16_t run;
+    uint16_t expect;
+  } entry[PLAN_LENGTH];
+} plan;
+
+/**
+  Advance the plan clock by one main loop pass and execute entries which are
+  due. Returns non-zero while the plan is running.
+*/
+static uint8_t plan_run(void) {
+
+  if (plan.state != PLAN_RUNNING) {
+    return 0;
+  }
+
+  while (plan.next < plan.count && plan.entry[plan.next].at <= plan.time) {
+    uint16_t run = plan.entry[plan.next].run;
+    uint16_t expect = plan.entry[plan.next].expect;
+    uint8_t v = (run & PLAN_VALVE2) && NUM_VALVES > 1;
+
+    if (expect &&
+        (temp_c[v] > expect ? temp_c[v] - expect : expect - temp_c[v])
+          > plan.bound) {
+      plan.state = PLAN_ABORTED;
+      return 0;
+    }
+
+    plan_ms = run & PLAN_MS;
+    if (plan_ms) {
+      motor_move(v, (run & PLAN_OPEN) ? '+' : '-');
+      answer[v].motor_moved = (run & PLAN_OPEN) ? '+' : '-';
+    }
+    plan_ms = 0;
+    plan.next++;
+  }
+
+  plan.time++;
+  if (plan.next >= plan.count) {
+    plan.state = PLAN_DONE;
+  }
+  return 1;
 }
+#endif /* MOVE_PLAN */
 
 /* ---- USB related functions --------------------------------------------- */
 
+#ifdef MEASURE_NOW
+/**
+  Set by poll_a_second() while the comparator is free for MEASURE_NOW.
+*/
+static uint8_t temp_window;
+
+static uint8_t temp_now(uint8_t sensor, uint16_t *raw);
+#endif
+
 /**
   We use control transfers to exchange data, up to 7 bytes at a time. As we
   don't have to comply with any standards, we can use all fields freely,
@@ -251,13 +1464,15 @@ static void motor_close(void) {
     } usbRequest_t;
 */
 usbMsgLen_t usbFunctionSetup(uchar data[8]) {
-#ifdef CAN_AFFORD_USB_COMMANDS
-  uint8_t len = 0;
+#if defined CAN_AFFORD_USB_COMMANDS || defined USB_VENDOR_REQUESTS
   // Cast to structured data for parsing.
   usbRequest_t *rq = (void *)data;
+#endif
+#ifdef CAN_AFFORD_USB_COMMANDS
+  uint8_t len = 0;
 
   if (rq->bRequest == 'c') {
-    reply.value[0] = temp_c;
+    reply.value[0] = temp_c[0];
     reply.byte[2] = motor_moved;
     len = 3;
     motor_moved = ' ';
@@ -269,8 +1484,165 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 #endif
   }
 
-  usbMsgPtr = reply.byte;
-  return len;
+  usbMsgPtr = reply.byte;
+  return len;
+#endif
+
+#ifdef DECISION_TRACE
+  if (rq->bRequest == 't') {
+    usbMsgPtr = (void *)&trace;
+    return sizeof(trace);
+  }
+#endif
+
+#ifdef MEASURE_NOW
+  if (rq->bRequest == 'm') {
+    static struct {
+      uint8_t status;
+      uint16_t raw;
+      uint16_t filtered;
+    } now;
+
+    uint8_t v = rq->wIndex.bytes[0];
+    uint16_t reading = 0;
+
+    // Not &now.raw, which may be unaligned on hosts, see HOST_BUILD.
+    now.status = temp_now(v, &reading);
+    now.raw = reading;
+    now.filtered = reading;
+    // Same as temp_filter(), without storing.
+    if (now.status == 0 && v < NUM_VALVES) {
+  #if TARGET_TEMPERATURE < 7000
+      now.filtered = (uint16_t)(temp_temp_eight[v] - temp_c[v] + reading) / 8;
+  #else
+      now.filtered = (uint16_t)(reading + temp_c[v] + 1) / 2;
+  #endif
+    }
+    usbMsgPtr = (void *)&now;
+    return sizeof(now);
+  }
+#endif
+
+#ifdef HEAT_DEMAND
+  if (rq->bRequest == 'd') {
+    usbMsgPtr = (void *)&demand;
+    return sizeof(demand);
+  }
+#endif
+
+#ifdef RIPPLE_COUNT
+  if (rq->bRequest == 'w') {
+    ripple_set[0] = rq->wValue.word;
+    ripple_set[1] = rq->wIndex.word;
+    return 0;
+  }
+  if (rq->bRequest == 'W') {
+    usbMsgPtr = (void *)&ripple;
+    return sizeof(ripple);
+  }
+#endif
+
+#ifdef ADAPTIVE_HORIZON
+  if (rq->bRequest == 'h') {
+    usbMsgPtr = (void *)horizon;
+    return sizeof(horizon);
+  }
+#endif
+
+#ifdef RAW_CAPTURE
+  if (rq->bRequest == 'r') {
+    usbMsgPtr = (void *)&raw;
+    return sizeof(raw);
+  }
+#endif
+
+#ifdef MOTOR_NOISE_STATS
+  if (rq->bRequest == 'n') {
+    usbMsgPtr = (void *)&motor_noise;
+    return sizeof(motor_noise);
+  }
+#endif
+
+#ifdef SUPPLY_COMPENSATION
+  if (rq->bRequest == 's') {
+    usbMsgPtr = (void *)&supply_scale;
+    return sizeof(supply_scale);
+  }
+#endif
+
+#ifdef MOVE_PLAN
+  // Not while plan_run() executes an entry, see MOVE_PLAN.
+  if (plan_ms && (rq->bRequest == 'p' || rq->bRequest == 'q' ||
+                  rq->bRequest == 'P')) {
+    return 0;
+  }
+  if (rq->bRequest == 'p') {
+    if (plan.count < PLAN_LENGTH) {
+      plan.entry[plan.count].at = rq->wValue.word;
+      plan.entry[plan.count].run = rq->wIndex.word;
+      plan.entry[plan.count].expect = 0;
+      plan.count++;
+    }
+    return 0;
+  }
+  if (rq->bRequest == 'q') {
+    if (plan.count) {
+      plan.entry[plan.count - 1].expect = rq->wValue.word;
+    }
+    return 0;
+  }
+  if (rq->bRequest == 'P') {
+    plan.bound = rq->wValue.word;
+    plan.next = 0;
+    plan.time = 0;
+    if (plan.bound) {
+      plan.state = PLAN_RUNNING;
+    } else {
+      plan.state = PLAN_IDLE;
+      plan.count = 0;
+    }
+    return 0;
+  }
+  if (rq->bRequest == 'Q') {
+    usbMsgPtr = (void *)&plan;
+    return 4;
+  }
+#endif
+
+#ifdef ALARMS
+  if (rq->bRequest == 'a') {
+    if (rq->wIndex.bytes[0] < sizeof(alarm_limit) / sizeof(alarm_limit[0])) {
+      alarm_limit[rq->wIndex.bytes[0]] = rq->wValue.word;
+    }
+    return 0;
+  }
+#endif
+
+#ifdef FRAME_SYNC
+  if (rq->bRequest == 'y') {
+    frame.offset = rq->wValue.word - frame.count;
+    frame.phase = rq->wIndex.word;
+    frame.synced = 1;
+    return 0;
+  }
+  if (rq->bRequest == 'Y') {
+    static uint16_t reply_frame[2];
+
+    reply_frame[0] = frame.count + frame.offset;
+    reply_frame[1] = frame.sampled;
+    usbMsgPtr = (void *)reply_frame;
+    return sizeof(reply_frame);
+  }
+#endif
+
+#ifdef EXTERNAL_SENSOR
+  if ((uint8_t)(rq->bRequest - 'e') < NUM_VALVES) {
+    uint8_t v = rq->bRequest - 'e';
+
+    temp_ext[v] = rq->wValue.word;
+    temp_ext_timeout[v] = rq->wIndex.word;
+    return 0;
+  }
 #endif
 
   usbMsgPtr = (void *)&answer;
@@ -289,9 +1661,15 @@ static void poll_a_second(void) {
 
   // Count to at least 5, else binary size grows significantly (50 bytes).
   for (i = 0; i < 25; i++) {
-    usbPoll();
+#ifdef MEASURE_NOW
+    temp_window = (i >= 3 && i <= 21);
+#endif
+    usb_poll();
     _delay_ms(40);
   }
+#ifdef MEASURE_NOW
+  temp_window = 0;
+#endif
 }
 
 /* ---- Temperature measurements ------------------------------------------ */
@@ -301,26 +1679,312 @@ static void poll_a_second(void) {
 */
 static void temp_init(void) {
 
+#ifdef TEMP_ADC
+  // AVCC reference, f/128 gives 100 kHz ADC clock at 12.8 MHz. The interrupt
+  // is used for waking up, only. Digital inputs off on the sensor pins.
+  ADMUX = (1 << REFS0);
+  ADCSRA = (1 << ADEN) | (1 << ADIE) |
+           (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+  DIDR0 = (1 << ADC0D) | (1 << ADC1D) | (1 << ADC2D) | (1 << ADC3D);
+  set_sleep_mode(ADC_SLEEP_MODE);
+#else
   /**
     The Analog Comparator can compare to an external voltage reference
-    connected to AIN0 (pin 12, PB0) or to an internal voltage reference.
+    connected to AIN1 (pin 13, PB1) or to an internal voltage reference.
     For now we use the external one, as our board provides such a thing.
+    The capacitor is on AIN0 (pin 12, PB0), so the comparator output rises
+    when the capacitor voltage passes the reference.
 
     Analog Comparator and its interrupt is enabled all the time, we protect
     against taking unwanted triggers into account in the interrupt routine.
   */
+#ifndef SUPPLY_COMPENSATION
   ACSR = (1 << ACIE) | (1 << ACIS0) | (1 << ACIS1);
+#else
+  // AIN0 and AIN1 swapped, see SUPPLY_COMPENSATION, so the output falls.
+  ACSR = (1 << ACIE) | (1 << ACIS1);
+#endif
 
   // Start Timer 1 with prescaling f/8.
   TCCR1B = (1 << CS11);
+#endif /* TEMP_ADC */
 
   SET_OUTPUT(TEMP_C);
+#ifdef DUAL_VALVE
+  SET_OUTPUT(TEMP_C2);
+#endif
 #ifdef MULTISENSOR_BROKEN
   SET_OUTPUT(TEMP_V);
   SET_OUTPUT(TEMP_R);
 #endif
 }
 
+/**
+  Smooth the raw reading in temp_temp into temp_c of valve v.
+
+  Note that we do many ADC readings between evaluations for the control
+  algorithm, so the reading is well smoothed in between and response to
+  temperature changes is as quick as without averaging.
+*/
+static void temp_filter(uint8_t v) {
+#ifdef RAW_CAPTURE
+  uint8_t head = raw.head[v];
+
+  raw.record[v][head].time = uptime;
+  raw.record[v][head].raw = temp_temp;
+  head++;
+  if (head >= RAW_LENGTH) {
+    head = 0;
+  }
+  raw.head[v] = head;
+#endif
+
+  #if TARGET_TEMPERATURE < 7000
+    // Use a moving average with 8 values. New readings count in at about 12%.
+    temp_temp_eight[v] -= temp_c[v];
+    temp_temp_eight[v] += temp_temp;
+    temp_c[v] = (temp_temp_eight[v] /*+ 4*/) / 8;  // '+ 4' for rounding
+  #else
+    // Use a two-point moving average, which allows readings up to 32767.
+    // The sum wraps at 16 bits, also where int is wider, see HOST_BUILD.
+    temp_c[v] = (uint16_t)(temp_temp + temp_c[v] + 1) / 2;
+  #endif
+}
+
+#ifdef ALARMS
+/**
+  Evaluate alarms of a valve after a measurement of its sensor, raw reading
+  still in temp_temp. Conditions:
+
+  - ALARM_BIT_FROST: filtered reading colder than alarm_limit[0].
+  - ALARM_BIT_RATE: warming by alarm_limit[1] or more since the previous
+    measurement, while the last motor movement closed the valve.
+  - ALARM_BIT_STUCK: alarm_limit[2] movements into the same direction
+    without the regulation ever asking for the other one.
+  - ALARM_BIT_SENSOR: raw reading below alarm_limit[3].
+*/
+static void alarm_check(uint8_t v) {
+  uint8_t active = 0;
+  uint16_t temp = temp_c[v];
+
+  if (temp > alarm_limit[0]) {
+    active |= ALARM_BIT_FROST;
+  }
+  // Warmer means smaller readings.
+  if (alarm[v].dir == '-' && alarm[v].last > temp &&
+      alarm[v].last - temp >= alarm_limit[1]) {
+    active |= ALARM_BIT_RATE;
+  }
+  if (alarm[v].moves >= alarm_limit[2]) {
+    active |= ALARM_BIT_STUCK;
+  }
+  if (temp_temp < alarm_limit[3]) {
+    active |= ALARM_BIT_SENSOR;
+  }
+  alarm[v].last = temp;
+
+  if (active != alarm[v].active) {
+    alarm[v].active = active;
+    alarm_dirty |= 1 << v;
+    alarm_send();
+  }
+}
+#endif /* ALARMS */
+
+/**
+  Sensors, see temp_charge().
+*/
+#define SENSOR_C    0
+#define SENSOR_C2   1
+#define SENSOR_V    2
+#define SENSOR_R    3
+
+/**
+  Start measuring a sensor: clear Timer 1 and start loading the capacitor.
+  ISR(ANA_COMP_vect) stops loading when done.
+*/
+static void temp_charge(uint8_t sensor) {
+
+  // Clear Timer 1. Write the high byte first to make it an atomic write.
+  // Interrupts locked, because a stale comparator trigger reads TCNT1L in
+  // between with ASM_COMPARATOR_ISR, which loads TEMP with the old high
+  // byte.
+  cli();
+  TCNT1H = 0;
+  TCNT1L = 0;
+  sei();
+
+  // Start loading the capacitor and as such, ADC.
+  conversion_done = 0;
+  temp_temp = 0;
+  switch (sensor) {
+    case SENSOR_C:
+      WRITE(TEMP_C, 1);
+      break;
+#ifdef DUAL_VALVE
+    case SENSOR_C2:
+      WRITE(TEMP_C2, 1);
+      break;
+#endif
+#ifdef MULTISENSOR_BROKEN
+    case SENSOR_V:
+      WRITE(TEMP_V, 1);
+      break;
+    case SENSOR_R:
+      WRITE(TEMP_R, 1);
+      break;
+#endif
+  }
+}
+
+#ifdef FRAME_SYNC
+/**
+  Wait for the next frame matching the host set phase, see FRAME_SYNC.
+*/
+static void frame_wait(void) {
+  uint16_t target;
+
+  if ( ! frame.synced) {
+    return;
+  }
+
+  target = frame.count +
+           ((frame.phase - frame.count - frame.offset) &
+            (FRAME_SYNC_PERIOD - 1));
+  while ((int16_t)(frame.count - target) < 0) {
+    usb_poll();
+  }
+  frame.sampled = frame.count + frame.offset;
+}
+#endif
+
+#ifdef TEMP_ADC
+/**
+  Measure one sensor with the ADC, see TEMP_ADC. Same interface as the
+  comparator version below, result in temp_temp. Never fails.
+*/
+static void temp_convert(uint8_t sensor);
+
+static uint8_t temp_sample(uint8_t sensor) {
+
+  #ifdef RESOURCE_ARBITER
+  while (res_blanking) {
+    usb_poll();
+    _delay_ms(40);
+    res_blanking--;
+  }
+  #endif
+  #ifdef FRAME_SYNC
+  if (sensor == SENSOR_C) {
+    frame_wait();
+  }
+  #endif
+
+  temp_convert(sensor);
+  return 1;
+}
+
+/**
+  The actual conversions of temp_sample().
+*/
+static void temp_convert(uint8_t sensor) {
+  uint16_t sum = 0;
+  uint8_t i;
+
+  // Power the divider. No capacitor, so it settles within the first
+  // conversion, which gets discarded.
+  temp_charge(sensor);
+  ADMUX = (1 << REFS0) | sensor;
+
+  sleep_enable();
+  for (i = 0; i <= 64; i++) {
+    ADCSRA |= (1 << ADSC);
+    // Interrupts locked between test and sleep, else a conversion finishing
+    // right there would have us sleep until some other interrupt.
+    cli();
+    while (ADCSRA & (1 << ADSC)) {
+      sei();
+      sleep_cpu();
+      cli();
+    }
+    sei();
+    if (i) {
+      sum += ADC;
+    }
+  }
+  sleep_disable();
+
+  WRITE(TEMP_C, 0);
+  #ifdef DUAL_VALVE
+  WRITE(TEMP_C2, 0);
+  #endif
+  #ifdef MULTISENSOR_BROKEN
+  WRITE(TEMP_V, 0);
+  WRITE(TEMP_R, 0);
+  #endif
+
+  // 64 conversions of 10 bits make 16 bits, of which 13 are significant.
+  temp_temp = sum >> 3;
+  conversion_done = 1;
+}
+
+/**
+  Only purpose of the ADC interrupt is to wake up from sleep.
+*/
+EMPTY_INTERRUPT(ADC_vect);
+
+#else /* ! TEMP_ADC */
+/**
+  Measure one sensor, result in temp_temp. Returns zero if there's no valid
+  result, which can happen with RESOURCE_ARBITER, only.
+
+  While ADC does its work, wait a second while polling USB.
+*/
+static uint8_t temp_sample(uint8_t sensor) {
+#ifdef RESOURCE_ARBITER
+  uint8_t tries;
+
+  for (tries = 0; tries <= TEMP_RETRIES; tries++) {
+    while (res_blanking) {
+      usb_poll();
+      _delay_ms(40);
+      res_blanking--;
+    }
+
+  #ifdef FRAME_SYNC
+    if (sensor == SENSOR_C) {
+      frame_wait();
+    }
+  #endif
+
+    temp_charge(sensor);
+    poll_a_second();
+
+    if (conversion_done) {
+      return 1;
+    }
+
+    // Comparator didn't trigger, so the capacitor still loads. Discharge
+    // before trying again.
+    WRITE(TEMP_C, 0);
+  #ifdef DUAL_VALVE
+    WRITE(TEMP_C2, 0);
+  #endif
+  #ifdef MULTISENSOR_BROKEN
+    WRITE(TEMP_V, 0);
+    WRITE(TEMP_R, 0);
+  #endif
+    res_blanking = 3;
+  }
+  return 0;
+#else
+  temp_charge(sensor);
+  poll_a_second();
+  return 1;
+#endif
+}
+#endif /* TEMP_ADC */
+
 /**
   Measure temperature sensor C.
 
@@ -330,82 +1994,170 @@ static void temp_init(void) {
   If the cap is sufficiently full, Analog Comparator triggers an interrupt to
   catch the counter value, measurement done.
 
-  Currently we have a voltage divider on board, delivering 1.08 volts to AIN0.
-  Capacitor is 1 uF. With the thermistor at 30 kOhms, we get values of
-  around 13500, so 14 significant bits. Such resolution is plenty, even with
-  an ordinary resistor replacing the thermistor we still measure jitter of
-  about 100 digits. Higher temperatures give lower numbers.
+  Currently we have a voltage divider on board, delivering 1.08 volts to AIN1.
+  The capacitor on AIN0 is 1 uF. With the thermistor at 30 kOhms, we get
+  values of around 13500, so 14 significant bits. Such resolution is plenty,
+  even with an ordinary resistor replacing the thermistor we still measure
+  jitter of about 100 digits. Higher temperatures give lower numbers.
 
   A measurement with these 30 kOhms (about the highest value we expect) takes
   about 10 ms. After that the capacitor should discharge for at least 50 ms,
   better 100 ms, so we can do some 6 measurements per second.
 
   This procedure measures all three sensors and takes about 0.6 seconds. USB
-  is taken care of.
+  is taken care of. With DUAL_VALVE, it also measures the second ISTA counter
+  sensor.
 */
 static void temp_measure(void) {
 
   /**
     First step is to measure the sensor connected to the ISTA counter.
   */
-  // Clear Timer 1. Write the high byte first to make it an atomic write.
-  TCNT1H = 0;
-  TCNT1L = 0;
-
-  // Start loading the capacitor and as such, ADC.
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_C, 1);
-
-  // While ADC does its work, wait a second while polling USB.
-  poll_a_second();
+  if (temp_sample(SENSOR_C)) {
+    // Store the new ADC reading with smoothing.
+    temp_filter(0);
+  }
+#ifdef ALARMS
+  alarm_check(0);
+#endif
 
-  // Store the new ADC reading with smoothing. Note that we do many ADC
-  // ADC readings between evaluations for the control algorithm, so the
-  // reading is well smoothed in between and response to temperature changes
-  // is as quick as without averaging.
-  #if TARGET_TEMPERATURE < 7000
-    // Use a moving average with 8 values. New readings count in at about 12%.
-    temp_temp_eight -= temp_c;
-    temp_temp_eight += temp_temp;
-    temp_c = (temp_temp_eight /*+ 4*/) / 8;  // '+ 4' for rounding
-  #else
-    // Use a two-point moving average, which allows readings up to 32767.
-    temp_c = (temp_temp + temp_c + 1) / 2;
+#ifdef DUAL_VALVE
+  /**
+    Same for the sensor on the second radiator's ISTA counter.
+  */
+  if (temp_sample(SENSOR_C2)) {
+    temp_filter(1);
+  }
+  #ifdef ALARMS
+  alarm_check(1);
   #endif
+#endif
 
 #ifdef MULTISENSOR_BROKEN
   /**
     Do the same for the sensor connected to the radiator valve.
   */
-  TCNT1H = 0;
-  TCNT1L = 0;
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_V, 1);
-  poll_a_second();
-  temp_v = temp_temp;
+  if (temp_sample(SENSOR_V)) {
+    temp_v = temp_temp;
+  }
 
   /**
     Third and last, measure the room temperature sensor.
   */
-  TCNT1H = 0;
-  TCNT1L = 0;
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_R, 1);
+  if (temp_sample(SENSOR_R)) {
+    temp_r = temp_temp;
+  }
+#endif
+
+#ifdef TEMP_ADC
+  // Measurements took just milliseconds. Keep a main loop pass at about a
+  // second, see RADIATOR_RESPONSE_TIME.
   poll_a_second();
-  temp_r = temp_temp;
 #endif
 
   // Done.
 }
 
+#ifdef MEASURE_NOW
+/**
+  Measure a sensor right away for request 'm', see MEASURE_NOW. Returns the
+  status of this request, the reading goes to *raw. temp_temp and
+  conversion_done get restored, so the regular measurement finds them as it
+  left them.
+*/
+static uint8_t temp_now(uint8_t sensor, uint16_t *raw) {
+  uint16_t temp_saved = temp_temp;
+  #ifndef TEMP_ADC
+  uint8_t i;
+  #endif
+
+  if ( ! temp_window || ! conversion_done ||
+  #ifdef SUPPLY_COMPENSATION
+      (ACSR & (1 << ACBG)) ||
+  #endif
+      ! (sensor == SENSOR_C
+  #ifdef DUAL_VALVE
+         || sensor == SENSOR_C2
+  #endif
+  #ifdef MULTISENSOR_BROKEN
+         || sensor == SENSOR_V || sensor == SENSOR_R
+  #endif
+      )) {
+    return 1;
+  }
+
+  #ifdef TEMP_ADC
+  temp_convert(sensor);
+  #else
+  // A charge takes about 10 ms, give up after 40 ms.
+  temp_charge(sensor);
+  for (i = 0; i < 40 && ! conversion_done; i++) {
+    _delay_ms(1);
+  }
+  if ( ! conversion_done) {
+    WRITE(TEMP_C, 0);
+    #ifdef DUAL_VALVE
+    WRITE(TEMP_C2, 0);
+    #endif
+    #ifdef MULTISENSOR_BROKEN
+    WRITE(TEMP_V, 0);
+    WRITE(TEMP_R, 0);
+    #endif
+    conversion_done = 1;
+    temp_temp = temp_saved;
+    return 2;
+  }
+  #endif
+
+  *raw = temp_temp;
+  temp_temp = temp_saved;
+  return 0;
+}
+#endif /* MEASURE_NOW */
+
+#ifdef SUPPLY_COMPENSATION
+/**
+  Measure supply voltage, see SUPPLY_COMPENSATION.
+
+  Sensor C is charged twice, first against the AIN0 reference as usual, then
+  against the bandgap. Each charge gets its full second to discharge, so
+  this takes about two seconds. Temperature doesn't change noticeably in
+  between.
+
+  Switching ACBG may trigger the comparator. This happens while
+  conversion_done is still set from the previous measurement, so it's
+  ignored like any other additional trigger.
+*/
+static void supply_measure(void) {
+  uint16_t time_ref = 0;
+  uint8_t i, ok = 1;
+
+  for (i = 0; i < 2; i++) {
+    ok &= temp_sample(SENSOR_C);
+
+    if (i == 0) {
+      time_ref = temp_temp;
+      ACSR |= (1 << ACBG);
+    }
+  }
+  ACSR &= ~(1 << ACBG);
+
+  // Keep the old value if a charge didn't complete.
+  if (ok && time_ref && temp_temp) {
+    supply_scale = ((uint32_t)temp_temp << 8) / time_ref;
+  }
+}
+#endif /* SUPPLY_COMPENSATION */
+
 /**
   Read out the temperature measurement result. Timer 1 is started at zero in
   temp_measure() and counts up until this interrupt is triggered. By reading
   Timer 1 here we get a measurement.
+
+  With ASM_COMPARATOR_ISR, anacomp.S implements this in assembly. Keep both
+  versions in sync.
 */
+#if ! defined ASM_COMPARATOR_ISR && ! defined TEMP_ADC
 ISR(ANA_COMP_vect) {
 
   /**
@@ -422,12 +2174,21 @@ ISR(ANA_COMP_vect) {
 
     // Start discharging.
     WRITE(TEMP_C, 0);
+#ifdef DUAL_VALVE
+    WRITE(TEMP_C2, 0);
+#endif
 #ifdef MULTISENSOR_BROKEN
     WRITE(TEMP_V, 0);
     WRITE(TEMP_R, 0);
 #endif
   }
+#ifdef MOTOR_NOISE_STATS
+  else if (motor_running) {
+    motor_noise.triggers++;
+  }
+#endif
 }
+#endif /* ! ASM_COMPARATOR_ISR && ! TEMP_ADC */
 
 /* ---- Application ------------------------------------------------------- */
 
@@ -441,6 +2202,12 @@ static void hardware_init(void) {
 
   // Set time 0 prescaler to 64 (see osctune.h).
   TCCR0B = 0x03;
+#ifdef HEAT_DEMAND
+  // Fast PWM on OC0A, TOP 0xFF, see HEAT_DEMAND.
+  TCCR0A = (1 << COM0A1) | (1 << WGM01) | (1 << WGM00);
+  OCR0A = 0;
+  SET_OUTPUT(DEMAND);
+#endif
 
   temp_init();
 
@@ -451,6 +2218,174 @@ static void hardware_init(void) {
   usbDeviceConnect();
 }
 
+#ifdef ADAPTIVE_HORIZON
+/**
+  Adjust the prediction horizon of valve v on a valve movement into
+  direction dir, see ADAPTIVE_HORIZON.
+*/
+static void horizon_adapt(uint8_t v, uint16_t temp, uint8_t dir) {
+  uint16_t h = horizon[v];
+  int8_t side = 0;
+
+  // Higher readings are colder.
+  if (temp > TARGET_TEMPERATURE + THERMISTOR_HYSTERESIS) {
+    side = 1;
+  } else if (temp < TARGET_TEMPERATURE - THERMISTOR_HYSTERESIS) {
+    side = -1;
+  }
+
+  if (horizon_last[v].side && side == -horizon_last[v].side) {
+    h += h / 8 + 1;
+  } else if (horizon_last[v].side && side == horizon_last[v].side &&
+             dir != horizon_last[v].dir) {
+    h -= h / 8 + 1;
+  }
+
+  if (h < HORIZON_MIN * 16) {
+    h = HORIZON_MIN * 16;
+  }
+  if (h > HORIZON_MAX * 16) {
+    h = HORIZON_MAX * 16;
+  }
+  horizon[v] = h;
+  horizon_last[v].dir = dir;
+  horizon_last[v].side = side;
+}
+#endif /* ADAPTIVE_HORIZON */
+
+#ifdef HEAT_DEMAND
+/**
+  Calculate heat demand from valve positions and temperatures and put it
+  out, see HEAT_DEMAND.
+*/
+static void demand_update(void) {
+  uint8_t v, level = 0;
+
+  for (v = 0; v < NUM_VALVES; v++) {
+    uint16_t d = (uint16_t)demand.pos[v] * 192 / DEMAND_STROKE;
+
+    // Higher readings are colder.
+    if (temp_c[v] > TARGET_TEMPERATURE) {
+      uint16_t cold = (temp_c[v] - TARGET_TEMPERATURE) / DEMAND_ERROR_STEP;
+
+      d += cold > 63 ? 63 : cold;
+    }
+    if (d > level) {
+      level = d;
+    }
+  }
+  demand.level = level;
+  OCR0A = level;
+}
+#endif /* HEAT_DEMAND */
+
+/**
+  This is the regulation algorithm for valve v. A tricky thing, because
+  temperature response to valve movements are extremely slow, some 10 minutes
+  on the Traumflug's radiator.
+
+  As we move the valve in increments only, not to absolute positions,
+  this is a pure integral ('I') regulator, no proportional of
+  differential part of PID. The big advantage of this is that we don't
+  have to know our absolute position; an information difficult to
+  get without endstops.
+
+  We use a full predictive model. Temperature change since the last
+  measurement is extrapolated, then the valve actuated to get this future
+  value into the hysteresis corridor. This should lead to valve movements
+  calming down in steady situations, still quick reactions on environment
+  changes.
+
+  Previous models used kind of a Bang-Bang, then with an additional look
+  at how much temperature changed. Both led to constant changes between
+  extremes.
+
+  One problem left is noise in temperature measurements. A countermeasure
+  would be a moving average, but we have neither sufficient Flash nor
+  sufficient RAM to implement such a thing.
+*/
+static TIMING_VISIBLE void regulate(uint8_t v) {
+  uint16_t temp_future = 0; // See struct answer above.
+  uint16_t temp = temp_c[v];
+  uint8_t motor_moved = ' ';
+#ifdef DECISION_TRACE
+  struct trace_record *r = trace_next();
+
+  r->flags = v;
+  r->pulse = 0;
+#endif
+
+#ifdef EXTERNAL_SENSOR
+  {
+    uint8_t use_ext = (temp_ext_timeout[v] != 0);
+
+    if (use_ext) {
+      temp = temp_ext[v];
+#ifdef DECISION_TRACE
+      r->flags |= 0x02;
+#endif
+    }
+    // Switching sources would extrapolate the offset between the two
+    // sensors, so pretend nothing changed for this step.
+    if (use_ext != temp_ext_used[v]) {
+      answer[v].temp_last = temp;
+      temp_ext_used[v] = use_ext;
+    }
+  }
+#endif
+
+  // Extrapolation. Take care of the sign.
+#ifdef ADAPTIVE_HORIZON
+  temp_future = temp + (int16_t)(((int32_t)horizon[v] *
+                ((int16_t)temp - (int16_t)answer[v].temp_last)) / 16);
+#else
+  temp_future = temp + PREDICTION_STEEPNESS *
+                ((int16_t)temp - (int16_t)answer[v].temp_last);
+#endif
+
+  // Act according to the prediction.
+  if (temp_future < (TARGET_TEMPERATURE - THERMISTOR_HYSTERESIS)) {
+    motor_moved = '-';
+#ifdef DECISION_TRACE
+    r->pulse = MOTOR_TIME(MOT_CLOSE_TIME);
+#endif
+  } else
+  if (temp_future > (TARGET_TEMPERATURE + THERMISTOR_HYSTERESIS)) {
+    motor_moved = '+';
+#ifdef DECISION_TRACE
+    r->pulse = MOTOR_TIME(MOT_OPEN_TIME);
+#endif
+  }
+
+#ifdef ADAPTIVE_HORIZON
+  if (motor_moved != ' ') {
+    horizon_adapt(v, temp, motor_moved);
+  }
+#endif
+
+#ifdef DECISION_TRACE
+  r->temp = temp;
+  r->slope = (int16_t)temp - (int16_t)answer[v].temp_last;
+  r->temp_future = temp_future;
+  r->reason = motor_moved;
+#endif
+
+#ifdef DUAL_VALVE
+  // Moving is up to motor_schedule(), which also sets motor_moved.
+  motor_request[v] = motor_moved;
+  if (motor_moved == ' ') {
+    answer[v].motor_moved = ' ';
+  }
+#else
+  if (motor_moved != ' ') {
+    motor_move(v, motor_moved);
+  }
+  answer[v].motor_moved = motor_moved;
+#endif
+
+  answer[v].temp_last = temp;
+}
+
 int main(void) {
   uint16_t time = 0;
   //uint16_t temp_last = 0; // See struct answer above.
@@ -460,59 +2395,54 @@ int main(void) {
   sei();
 
   for (;;) {    /* main event loop */
+    uint8_t v;
 
     temp_measure(); // Also polls USB.
 
-    time++;
+#if defined DECISION_TRACE || defined RAW_CAPTURE
+    uptime++;
+#endif
+
+#ifdef EXTERNAL_SENSOR
+    for (v = 0; v < NUM_VALVES; v++) {
+      if (temp_ext_timeout[v] > PASS_SECONDS) {
+        temp_ext_timeout[v] -= PASS_SECONDS;
+      }
+      else {
+        temp_ext_timeout[v] = 0;
+      }
+    }
+#endif
+
+#ifdef MOVE_PLAN
+    // Pause regulation while a plan runs.
+    if (plan_run()) {
+      time = 0;
+    }
+#endif
+
+    time += PASS_SECONDS;
     // Loop count here also depends on how much poll_a_second() actually
     // delays and how often temp_measure() calls poll_a_second().
     if (time > RADIATOR_RESPONSE_TIME) {
-      uint16_t temp_future = 0; // See struct answer above.
-
-      /**
-        This is the regulation algorithm. A tricky thing, because temperature
-        response to valve movements are extremely slow, some 10 minutes on
-        the Traumflug's radiator.
-
-        As we move the valve in increments only, not to absolute positions,
-        this is a pure integral ('I') regulator, no proportional of
-        differential part of PID. The big advantage of this is that we don't
-        have to know our absolute position; an information difficult to
-        get without endstops.
-
-        We use a full predictive model. Temperature change since the last
-        measurement is extrapolated, then the valve actuated to get this future
-        value into the hysteresis corridor. This should lead to valve movements
-        calming down in steady situations, still quick reactions on environment
-        changes.
-
-        Previous models used kind of a Bang-Bang, then with an additional look
-        at how much temperature changed. Both led to constant changes between
-        extremes.
-
-        One problem left is noise in temperature measurements. A countermeasure
-        would be a moving average, but we have neither sufficient Flash nor
-        sufficient RAM to implement such a thing.
-      */
-      // Extrapolation. Take care of the sign.
-      temp_future = temp_c + PREDICTION_STEEPNESS *
-                    ((int16_t)temp_c - (int16_t)answer.temp_last);
-
-      // Act according to the prediction.
-      if (temp_future < (TARGET_TEMPERATURE - THERMISTOR_HYSTERESIS)) {
-        motor_close();
-        answer.motor_moved = '-';
-      } else
-      if (temp_future > (TARGET_TEMPERATURE + THERMISTOR_HYSTERESIS)) {
-        motor_open();
-        answer.motor_moved = '+';
-      } else {
-        answer.motor_moved = ' ';
+#ifdef SUPPLY_COMPENSATION
+      supply_measure();
+#endif
+      for (v = 0; v < NUM_VALVES; v++) {
+        regulate(v);
       }
-
       time = 0;
-      answer.temp_last = temp_c;
+#ifdef HOST_BUILD
+      host_regulations++;
+#endif
     }
+
+#ifdef DUAL_VALVE
+    motor_schedule();
+#endif
+
+#ifdef HEAT_DEMAND
+    demand_update();
+#endif
   }
 }
-
@@ -32,7 +32,12 @@
 #ifndef _PINIO_H
 #define _PINIO_H
 
-#include <avr/io.h>
+// Not hal.h, this file is also included from assembly.
+#ifndef HOST_BUILD
+  #include <avr/io.h>
+#else
+  #include "host/hal_host.h"
+#endif
 
 
 #ifndef MASK
@@ -98,12 +103,17 @@
 #define LED_Y_PWM       NULL
 
 // Green LED on PB2.
-#define LED_G_PIN       PINB6
+#define LED_G_PIN       PINB2
 #define LED_G_RPORT     PINB
 #define LED_G_WPORT     PORTB
 #define LED_G_DDR       DDRB
 #define LED_G_PWM       NULL
 
+/**
+  Temperature sensor pins charge the capacitor. With TEMP_ADC in main.c they
+  power the sensor's voltage divider instead, which connects to ADC0 (TEMP_C),
+  ADC1 (TEMP_C2), ADC2 (TEMP_V) or ADC3 (TEMP_R).
+*/
 // Temperature sensor on the ISTA counter.
 // Currently PD3, which likely changes, as this pin is also INT1.
 #define TEMP_C_PIN      PIND3
@@ -140,4 +150,56 @@
 #define MOT_CLOSE_DDR   DDRB
 #define MOT_CLOSE_PWM   &OC1B
 
+/**
+  Second radiator, see DUAL_VALVE in main.c. Spare pins only, so the motor
+  shares PB5 (MOSI) and PB7 (SCK) with the ISP header. Unplug this motor
+  while programming.
+*/
+// Temperature sensor on the second ISTA counter. Same capacitor as TEMP_C.
+#define TEMP_C2_PIN     PIND0
+#define TEMP_C2_RPORT   PIND
+#define TEMP_C2_WPORT   PORTD
+#define TEMP_C2_DDR     DDRD
+#define TEMP_C2_PWM     NULL
+
+// Second valve motor, open direction.
+#define MOT2_OPEN_PIN   PINB5
+#define MOT2_OPEN_RPORT PINB
+#define MOT2_OPEN_WPORT PORTB
+#define MOT2_OPEN_DDR   DDRB
+#define MOT2_OPEN_PWM   NULL
+
+// Second valve motor, close direction.
+#define MOT2_CLOSE_PIN  PINB7
+#define MOT2_CLOSE_RPORT PINB
+#define MOT2_CLOSE_WPORT PORTB
+#define MOT2_CLOSE_DDR  DDRB
+#define MOT2_CLOSE_PWM  NULL
+
+/**
+  Motor current ripple input, see RIPPLE_COUNT in main.c. A sense resistor in
+  the motors' ground return, conditioned to logic levels by an external
+  comparator stage. The on-chip comparator is taken by the temperature
+  capacitor and ICP (PD6) by the yellow LED, so this uses pin change
+  interrupt PCINT6 on PB6 (MISO). Connect the stage through a series
+  resistor of 1 kOhm or more, so it doesn't fight the programmer.
+*/
+#define RIPPLE_PIN      PINB6
+#define RIPPLE_RPORT    PINB
+#define RIPPLE_WPORT    PORTB
+#define RIPPLE_DDR      DDRB
+#define RIPPLE_PWM      NULL
+
+/**
+  Heat demand output, see HEAT_DEMAND in main.c. PWM of OC0A on PB2, which
+  also drives the green LED, so the LED shows demand by brightness. Boiler or
+  pump controls connect via an optocoupler or open collector transistor in
+  parallel to the LED.
+*/
+#define DEMAND_PIN      PINB2
+#define DEMAND_RPORT    PINB
+#define DEMAND_WPORT    PORTB
+#define DEMAND_DDR      DDRB
+#define DEMAND_PWM      &OC0A
+
 #endif /* _PINIO_H */
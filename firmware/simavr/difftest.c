@@ -0,0 +1,326 @@
+/** \file difftest.c
+
+  Differential test: runs firmware.elf in simavr with the raw readings of a
+  reference run of the host build, see host/difftest.c, and compares what
+  both made of them, pass by pass. The host build has a 32 bit int, the
+  AVR a 16 bit one, so arithmetic may differ where main.c relies on either.
+
+  Usage: ./difftest [-e elf] [-m mcu] [reference]
+
+    -e  Firmware to run, default build/difftest.elf, see Makefile. Needs
+        DECISION_TRACE.
+    -m  MCU name as simavr knows it, default attiny2313.
+
+  Without reference, it's read from stdin, so the host run can be piped in.
+
+  Compared are temp_c, and temp_future and the decision of each regulation
+  step, taken from the DECISION_TRACE ring. The comparator triggers after
+  the reference's raw reading times 8 cycles, like timing.c does, but the
+  ISR latches Timer 1 some cycles later, so the raw reading gets written to
+  temp_temp after the ISR, before the main loop looks at it.
+
+  Output is the first divergence, with both lines, and exit code 1, or the
+  number of passes without divergence and exit code 0.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <libelf.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_acomp.h>
+
+#ifndef F_CPU
+  #define F_CPU 12800000UL
+#endif
+
+/**
+  Comparator input voltages, in millivolts, see timing.c.
+*/
+#define AIN1_MV       1080
+#define AIN0_FULL_MV  1500
+
+/**
+  ACSR in data space and its bandgap bit, ATtiny2313. Measurements against
+  the bandgap don't start a main loop pass.
+*/
+#define ACSR_ADDR     0x28
+#define ACBG_BIT      6
+
+/**
+  Size of struct trace_record in main.c, and offsets of what we compare.
+*/
+#define TRACE_RECORD       12
+#define TRACE_TEMP         2
+#define TRACE_TEMP_FUTURE  6
+#define TRACE_REASON       10
+#define TRACE_FLAGS        11
+
+/**
+  Longest main loop pass, in seconds, before we consider the firmware hung.
+*/
+#define PASS_TIMEOUT  10
+
+#define MAX_LINE      256
+
+
+/* ---- Variables in RAM -------------------------------------------------- */
+
+static struct variable {
+  const char *name;
+  uint16_t addr;
+  uint16_t size;
+} variables[] = {
+  { "temp_c" },
+  { "temp_temp" },
+  { "conversion_done" },
+  { "trace" },
+};
+
+enum { VAR_TEMP_C, VAR_TEMP_TEMP, VAR_CONVERSION_DONE, VAR_TRACE, VARS };
+
+/**
+  Find the RAM variables above, static ones included. RAM symbols are at
+  0x800000 and up, the rest is the address in data space.
+*/
+static int variables_load(const char *path) {
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  Elf_Data *data;
+  const char *name;
+  int fd, i, n, v;
+
+  elf_version(EV_CURRENT);
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || ! (elf = elf_begin(fd, ELF_C_READ, NULL))) {
+    return -1;
+  }
+
+  while ((scn = elf_nextscn(elf, scn))) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    data = elf_getdata(scn, NULL);
+    n = shdr.sh_size / shdr.sh_entsize;
+    for (i = 0; i < n; i++) {
+      gelf_getsym(data, i, &sym);
+      if (sym.st_value < 0x800000 || sym.st_shndx == SHN_UNDEF) {
+        continue;
+      }
+      name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+      for (v = 0; v < VARS; v++) {
+        if ( ! strcmp(name, variables[v].name)) {
+          variables[v].addr = sym.st_value & 0xFFFF;
+          variables[v].size = sym.st_size;
+        }
+      }
+    }
+  }
+  elf_end(elf);
+  close(fd);
+
+  for (v = 0; v < VARS; v++) {
+    if ( ! variables[v].addr) {
+      fprintf(stderr, "No variable %s in %s.\n", variables[v].name, path);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* ---- Passes ------------------------------------------------------------ */
+
+static avr_t *avr;
+static avr_irq_t *ain0;
+
+static FILE *reference;
+static char expected[MAX_LINE];
+static uint32_t pass;
+static uint16_t raw;
+static uint8_t head, patch, diverged, done;
+static avr_cycle_count_t pass_start;
+
+static uint16_t get16(uint16_t addr) {
+  return avr->data[addr] | (avr->data[addr + 1] << 8);
+}
+
+/**
+  The line of the pass just done, formatted like host/difftest.c does.
+*/
+static void pass_line(char *line, size_t size) {
+  uint16_t r;
+  size_t len;
+  uint8_t v;
+
+  len = snprintf(line, size, "%u,%u", pass, raw);
+  for (v = 0; v < variables[VAR_TEMP_C].size / 2; v++) {
+    len += snprintf(line + len, size - len, ",%u",
+                    get16(variables[VAR_TEMP_C].addr + 2 * v));
+  }
+  while (head != avr->data[variables[VAR_TRACE].addr]) {
+    r = variables[VAR_TRACE].addr + 1 + head * TRACE_RECORD;
+    len += snprintf(line + len, size - len, ",v%u %u %u %c",
+                    avr->data[r + TRACE_FLAGS] & 0x01,
+                    get16(r + TRACE_TEMP), get16(r + TRACE_TEMP_FUTURE),
+                    avr->data[r + TRACE_REASON]);
+    head = (head + 1) % ((variables[VAR_TRACE].size - 1) / TRACE_RECORD);
+  }
+  snprintf(line + len, size - len, "\n");
+}
+
+/**
+  Compare the pass just done, then fetch the raw reading of the next one.
+*/
+static void pass_next(void) {
+  char line[MAX_LINE];
+
+  if (pass) {
+    pass_line(line, sizeof(line));
+    if (strcmp(line, expected)) {
+      printf("First divergence in pass %u:\n  host:  %s  simavr: %s", pass,
+             expected, line);
+      diverged = 1;
+      return;
+    }
+  }
+
+  do {
+    if ( ! fgets(expected, sizeof(expected), reference)) {
+      done = 1;
+      return;
+    }
+  } while ( ! strncmp(expected, "pass", 4));
+
+  if (sscanf(expected, "%u,%hu", &pass, &raw) != 2) {
+    fprintf(stderr, "Can't parse reference line: %s", expected);
+    done = 1;
+    return;
+  }
+  pass_start = avr->cycle;
+}
+
+static avr_cycle_count_t charge_done(avr_t *sim, avr_cycle_count_t when,
+                                     void *param) {
+  avr_raise_irq(ain0, AIN0_FULL_MV);
+  return 0;
+}
+
+static void sensor_pin(struct avr_irq_t *irq, uint32_t value, void *param) {
+
+  if (value) {
+    if (param && ! (avr->data[ACSR_ADDR] & (1 << ACBG_BIT))) {
+      pass_next();
+    }
+    avr_cycle_timer_register(avr, raw * 8ULL, charge_done, NULL);
+    patch = 1;
+  }
+  else {
+    avr_cycle_timer_cancel(avr, charge_done, NULL);
+    avr_raise_irq(ain0, 0);
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  const char *elf_path = "build/difftest.elf", *mcu = "attiny2313";
+  elf_firmware_t firmware;
+  int opt, state;
+
+  while ((opt = getopt(argc, argv, "e:m:")) != -1) {
+    switch (opt) {
+      case 'e': elf_path = optarg; break;
+      case 'm': mcu = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-e elf] [-m mcu] [reference]\n", argv[0]);
+        return 2;
+    }
+  }
+  reference = stdin;
+  if (optind < argc && ! (reference = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 2;
+  }
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(elf_path, &firmware) || variables_load(elf_path)) {
+    fprintf(stderr, "Can't read %s.\n", elf_path);
+    return 2;
+  }
+  avr = avr_make_mcu_by_name(mcu);
+  if ( ! avr) {
+    fprintf(stderr, "simavr doesn't know %s.\n", mcu);
+    return 2;
+  }
+  avr_init(avr);
+  avr->frequency = F_CPU;
+  avr_load_firmware(avr, &firmware);
+
+  // Comparator: reference on AIN1, capacitor on AIN0, see pinio.h.
+  ain0 = avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN0);
+  if ( ! ain0) {
+    fprintf(stderr, "simavr has no analog comparator for %s.\n", mcu);
+    return 2;
+  }
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN1),
+                AIN1_MV);
+  avr_raise_irq(ain0, 0);
+
+  // TEMP_C on PD3 starts a pass, TEMP_C2 on PD0 reads the same.
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 3),
+                          sensor_pin, (void *)1);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 0),
+                          sensor_pin, NULL);
+
+  while ( ! diverged && ! done) {
+    state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "Firmware stopped at 0x%04x.\n", avr->pc);
+      return 2;
+    }
+    if (avr->cycle - pass_start > PASS_TIMEOUT * (uint64_t)F_CPU) {
+      fprintf(stderr, "Pass %u didn't end within %u seconds.\n", pass,
+              PASS_TIMEOUT);
+      return 2;
+    }
+
+    // Replace what the ISR latched with the exact reading.
+    if (patch && avr->data[variables[VAR_CONVERSION_DONE].addr]) {
+      avr->data[variables[VAR_TEMP_TEMP].addr] = raw & 0xFF;
+      avr->data[variables[VAR_TEMP_TEMP].addr + 1] = raw >> 8;
+      patch = 0;
+    }
+  }
+
+  if (diverged) {
+    return 1;
+  }
+  printf("No divergence in %u passes.\n", pass);
+  return 0;
+}
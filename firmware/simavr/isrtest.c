@@ -0,0 +1,371 @@
+/** \file isrtest.c
+
+  Equivalence test of the two versions of ISR(ANA_COMP_vect), the C one in
+  main.c and the assembly one in anacomp.S. Runs one firmware.elf in simavr
+  with a fixed sequence of comparator edges and writes what the ISR left
+  behind after each of them. The Makefile runs this on both builds and
+  compares the outputs, see 'make isrtest'.
+
+  Usage: ./isrtest [-e elf] [-m mcu]
+
+    -e  Firmware to run, default build/isrtest-c.elf, see Makefile.
+    -m  MCU name as simavr knows it, default attiny2313.
+
+  Each charge of TEMP_C or TEMP_C2 gets one step of the sequence. Some
+  cycles after the pin went high, Timer 1 gets set to the step's count and
+  AIN0 rises above AIN1, once or a few times. Steps either stop Timer 1, so
+  both versions have to latch exactly this count, or let it run on. Then the
+  latched count has to be one Timer 1 had between edge and sample, which
+  catches torn reads of its two bytes. Counts with the low byte at 0xFF and
+  0x00 are what would tear.
+
+  Repeated edges come after the ISR is done, or in a burst while it runs.
+  They must not change anything. Edges of a burst get one sample after the
+  last one, as the two versions pass through their states at different
+  cycles.
+
+  Output, one line per sample:
+
+    step,edge,temp_temp,conversion_done,temp_c,temp_c2
+
+  temp_temp is the latched count in hex, or 'ok' for a running Timer 1 and
+  a count in range. temp_c and temp_c2 are the port bits of these pins.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <libelf.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_acomp.h>
+
+#ifndef F_CPU
+  #define F_CPU 12800000UL
+#endif
+
+/**
+  Comparator input voltages, in millivolts, see timing.c.
+*/
+#define AIN1_MV       1080
+#define AIN0_FULL_MV  1500
+
+/**
+  Registers in data space, ATtiny2313. TEMP_C is PD3, TEMP_C2 PD0.
+*/
+#define PORTD_ADDR    0x32
+#define TCNT1L_ADDR   0x4C
+#define TCNT1H_ADDR   0x4D
+#define TCCR1B_ADDR   0x4E
+#define TEMP_C_BIT    3
+#define TEMP_C2_BIT   0
+
+/**
+  Cycles from the pin going high to the first edge, length of an edge and
+  cycles from an edge to its sample. Both ISR versions, nested USB
+  interrupts and a second run for a pending trigger are done by then.
+*/
+#define EDGE_DELAY    800
+#define EDGE_LENGTH   2
+#define SETTLE        400
+
+/**
+  Longest wait for the next charge, in seconds.
+*/
+#define STEP_TIMEOUT  10
+
+
+/* ---- Variables in RAM -------------------------------------------------- */
+
+static struct variable {
+  const char *name;
+  uint16_t addr;
+} variables[] = {
+  { "temp_temp" },
+  { "conversion_done" },
+};
+
+enum { VAR_TEMP_TEMP, VAR_CONVERSION_DONE, VARS };
+
+/**
+  Find the RAM variables above, see difftest.c.
+*/
+static int variables_load(const char *path) {
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  Elf_Data *data;
+  const char *name;
+  int fd, i, n, v;
+
+  elf_version(EV_CURRENT);
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || ! (elf = elf_begin(fd, ELF_C_READ, NULL))) {
+    return -1;
+  }
+
+  while ((scn = elf_nextscn(elf, scn))) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    data = elf_getdata(scn, NULL);
+    n = shdr.sh_size / shdr.sh_entsize;
+    for (i = 0; i < n; i++) {
+      gelf_getsym(data, i, &sym);
+      if (sym.st_value < 0x800000 || sym.st_shndx == SHN_UNDEF) {
+        continue;
+      }
+      name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+      for (v = 0; v < VARS; v++) {
+        if ( ! strcmp(name, variables[v].name)) {
+          variables[v].addr = sym.st_value & 0xFFFF;
+        }
+      }
+    }
+  }
+  elf_end(elf);
+  close(fd);
+
+  for (v = 0; v < VARS; v++) {
+    if ( ! variables[v].addr) {
+      fprintf(stderr, "No variable %s in %s.\n", variables[v].name, path);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* ---- Sequence ---------------------------------------------------------- */
+
+/**
+  One step per charge. tcnt1 is what Timer 1 gets set to at the first
+  edge, with a stopped Timer 1 plus 0x0101 for each following one, so a
+  second latch shows. gap is the number of cycles between edges.
+*/
+static const struct step {
+  uint16_t tcnt1;
+  uint8_t running;
+  uint8_t edges;
+  uint16_t gap;
+} steps[] = {
+  { 0x1234, 0, 1, 0 },
+  { 0x12FF, 0, 1, 0 },
+  { 0x1300, 0, 1, 0 },
+  { 0x00FF, 0, 1, 0 },
+  { 0xFFFF, 0, 1, 0 },
+  { 0x0000, 0, 1, 0 },
+  { 0x16A8, 0, 3, 1000 },
+  { 0x16A8, 0, 3, 10 },
+  { 0x16A8, 0, 4, 3 },
+  { 0x12FE, 1, 1, 0 },
+  { 0x12FF, 1, 1, 0 },
+  { 0x1300, 1, 1, 0 },
+  { 0x17FF, 1, 1, 0 },
+  { 0xFFFE, 1, 1, 0 },
+  { 0x12FF, 1, 3, 1000 },
+};
+
+#define STEPS (sizeof(steps) / sizeof(steps[0]))
+
+static avr_t *avr;
+static avr_irq_t *ain0;
+
+static uint8_t step, edge, active, done, tccr1b;
+static avr_cycle_count_t first_edge, step_start;
+
+static uint16_t get16(uint16_t addr) {
+  return avr->data[addr] | (avr->data[addr + 1] << 8);
+}
+
+/**
+  Write an I/O register like the firmware does, so simavr's timer sees it.
+*/
+static void io_write(uint16_t addr, uint8_t value) {
+  uint8_t io = AVR_DATA_TO_IO(addr);
+
+  if (avr->io[io].w.c) {
+    avr->io[io].w.c(avr, addr, value, avr->io[io].w.param);
+  }
+  else {
+    avr->data[addr] = value;
+  }
+}
+
+static void timer1_set(uint16_t count) {
+  // High byte first, through TEMP, as on the device.
+  io_write(TCNT1H_ADDR, count >> 8);
+  io_write(TCNT1L_ADDR, count & 0xFF);
+}
+
+static avr_cycle_count_t sample(avr_t *sim, avr_cycle_count_t when,
+                                void *param) {
+  const struct step *s = &steps[step];
+  uint16_t latched = get16(variables[VAR_TEMP_TEMP].addr);
+  uint32_t highest;
+
+  printf("%u,%u,", step, edge);
+  if (s->running) {
+    // Timer 1 counts at F_CPU / 8, one more for the prescaler's phase.
+    highest = s->tcnt1 + (sim->cycle - first_edge) / 8 + 1;
+    if (latched >= s->tcnt1 && latched <= highest) {
+      printf("ok");
+    }
+    else {
+      printf("0x%04x", latched);
+    }
+  }
+  else {
+    printf("0x%04x", latched);
+  }
+  printf(",%u,%u,%u\n", avr->data[variables[VAR_CONVERSION_DONE].addr],
+         (avr->data[PORTD_ADDR] >> TEMP_C_BIT) & 0x01,
+         (avr->data[PORTD_ADDR] >> TEMP_C2_BIT) & 0x01);
+
+  if (edge + 1 == s->edges) {
+    if ( ! s->running) {
+      io_write(TCCR1B_ADDR, tccr1b);
+    }
+    active = 0;
+    step++;
+    done = (step == STEPS);
+  }
+  return 0;
+}
+
+static avr_cycle_count_t edge_end(avr_t *sim, avr_cycle_count_t when,
+                                  void *param) {
+  avr_raise_irq(ain0, 0);
+  return 0;
+}
+
+static avr_cycle_count_t edge_start(avr_t *sim, avr_cycle_count_t when,
+                                    void *param) {
+  const struct step *s = &steps[step];
+
+  if ( ! active) {
+    return 0;
+  }
+  if (param) {
+    edge++;
+  }
+  else {
+    edge = 0;
+    first_edge = sim->cycle;
+    if ( ! s->running) {
+      tccr1b = avr->data[TCCR1B_ADDR];
+      io_write(TCCR1B_ADDR, tccr1b & ~0x07);
+    }
+    timer1_set(s->tcnt1);
+  }
+  if (edge && ! s->running) {
+    timer1_set(s->tcnt1 + edge * 0x0101);
+  }
+
+  avr_raise_irq(ain0, AIN0_FULL_MV);
+  avr_cycle_timer_register(sim, EDGE_LENGTH, edge_end, NULL);
+
+  // Sample after each edge, or after the last one of a burst.
+  if (edge + 1 == s->edges || s->gap >= SETTLE) {
+    avr_cycle_timer_register(sim, SETTLE, sample, NULL);
+  }
+  if (edge + 1 < s->edges) {
+    avr_cycle_timer_register(sim, s->gap, edge_start, (void *)1);
+  }
+  return 0;
+}
+
+static void sensor_pin(struct avr_irq_t *irq, uint32_t value, void *param) {
+
+  if (value && ! active && ! done) {
+    active = 1;
+    step_start = avr->cycle;
+    avr_cycle_timer_register(avr, EDGE_DELAY, edge_start, NULL);
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  const char *elf_path = "build/isrtest-c.elf", *mcu = "attiny2313";
+  elf_firmware_t firmware;
+  int opt, state;
+
+  while ((opt = getopt(argc, argv, "e:m:")) != -1) {
+    switch (opt) {
+      case 'e': elf_path = optarg; break;
+      case 'm': mcu = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-e elf] [-m mcu]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(elf_path, &firmware) || variables_load(elf_path)) {
+    fprintf(stderr, "Can't read %s.\n", elf_path);
+    return 2;
+  }
+  avr = avr_make_mcu_by_name(mcu);
+  if ( ! avr) {
+    fprintf(stderr, "simavr doesn't know %s.\n", mcu);
+    return 2;
+  }
+  avr_init(avr);
+  avr->frequency = F_CPU;
+  avr_load_firmware(avr, &firmware);
+
+  // Comparator: reference on AIN1, capacitor on AIN0, see pinio.h.
+  ain0 = avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN0);
+  if ( ! ain0) {
+    fprintf(stderr, "simavr has no analog comparator for %s.\n", mcu);
+    return 2;
+  }
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN1),
+                AIN1_MV);
+  avr_raise_irq(ain0, 0);
+
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'),
+                                        TEMP_C_BIT), sensor_pin, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'),
+                                        TEMP_C2_BIT), sensor_pin, NULL);
+
+  printf("step,edge,temp_temp,conversion_done,temp_c,temp_c2\n");
+  while ( ! done) {
+    state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "Firmware stopped at 0x%04x.\n", avr->pc);
+      return 2;
+    }
+    if (avr->cycle - step_start > STEP_TIMEOUT * (uint64_t)F_CPU) {
+      fprintf(stderr, "No charge for step %u within %u seconds.\n", step,
+              STEP_TIMEOUT);
+      return 2;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,661 @@
+/** \file timing.c
+
+  Cycle counts of the firmware's time critical paths, measured on the real
+  firmware.elf running in simavr.
+
+  Usage: ./timing [-e elf] [-m mcu] [-v vector] [-u vector] [-s seconds]
+                  [-b budget] [-f script] [-r interval]
+
+    -e  Firmware to run, default build/firmware.elf, see Makefile.
+    -m  MCU name as simavr knows it, default attiny2313.
+    -v  Vector number of ANA_COMP, default 10 (ATtiny2313).
+    -u  Vector number of the USB interrupt (INT0), default 1.
+    -s  Simulated seconds, default 250, which gives two regulation steps.
+    -b  Longest allowed interrupt lock, in cycles. Default is the 25 cycles
+        at 12 MHz from "Interrupt latency" in usbdrv.h, scaled to F_CPU.
+    -f  Charge script, one Timer 1 count per line. Default is a built-in
+        sequence around TARGET_TEMPERATURE, including counts with the low
+        byte at 0xFF and 0x00.
+    -r  Milliseconds between injected USB requests, default 20, 0 for none.
+
+  The script drives the comparator: when TEMP_C or TEMP_C2 goes high, AIN0
+  rises above AIN1 after the next count of the script times 8 cycles (Timer
+  1 runs at F_CPU / 8). Setting the pin low discharges.
+
+  Measured are cycles from entry to return of each path, including
+  interrupts nested into it:
+
+    ANA_COMP_vect     the comparator ISR, C or assembly version.
+    usbPoll           idle, nothing received and no reply to build. There's
+                      no host, so V-USB sees the bus in reset.
+    usbPoll+request   with a received SETUP packet to process, or a reply
+                      to build. This is the worst case of usbPoll().
+    regulate          the control step, only passes without a valve
+                      movement, as these contain the motor run time.
+                      Needs TIMING_BUILD, see main.c.
+    regulate+move     passes with a valve movement, for completeness.
+
+  Requests are injected the way V-USB's interrupt leaves them after
+  receiving a SETUP packet: into usbRxBuf, with usbRxToken and usbRxLen set.
+  Bit level reception isn't simulated, its cost shows in the interrupt
+  lock of the USB vector. Injected are standard requests of an enumeration
+  and the vendor requests which read only, 'm' of MEASURE_NOW included,
+  which measures while usbPoll() waits. A request comes between two calls
+  of usbPoll() and waits while the previous one is still in the buffer.
+
+  Also measured are all stretches with interrupts locked, outside the USB
+  interrupt itself, by where they begin. Each of them delays the USB
+  interrupt. If one exceeds the budget, the result is FAIL and the exit
+  code 1, so scripts and make can stop on it.
+
+  Output is CSV, one section for paths, one for interrupt locks, then the
+  verdict.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <libelf.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_acomp.h>
+
+#ifndef F_CPU
+  #define F_CPU 12800000UL
+#endif
+
+/**
+  Comparator input voltages, in millivolts, as simavr takes them.
+*/
+#define AIN1_MV       1080
+#define AIN0_FULL_MV  1500
+
+#define MAX_SYMBOLS   1024
+#define MAX_DEPTH     16
+#define MAX_SCRIPT    4096
+
+/**
+  SETUP packet ID, see usbdrv.h. USB_NO_MSG for usbMsgLen_t of one byte,
+  as without USB_CFG_LONG_TRANSFERS.
+*/
+#define USBPID_SETUP  0x2D
+#define USB_NO_MSG    0xFF
+#define USB_BUFSIZE   11
+
+
+/* ---- Symbols ----------------------------------------------------------- */
+
+static struct symbol {
+  char *name;
+  uint32_t addr;
+  uint32_t size;
+} symbols[MAX_SYMBOLS];
+static int symbol_count;
+
+/**
+  V-USB's variables in RAM, for injecting requests.
+*/
+static struct variable {
+  const char *name;
+  uint16_t addr;
+} variables[] = {
+  { "usbRxBuf" },
+  { "usbInputBufOffset" },
+  { "usbRxLen" },
+  { "usbRxToken" },
+  { "usbTxLen" },
+  { "usbMsgLen" },
+};
+
+enum {
+  VAR_RX_BUF,
+  VAR_INPUT_BUF_OFFSET,
+  VAR_RX_LEN,
+  VAR_RX_TOKEN,
+  VAR_TX_LEN,
+  VAR_MSG_LEN,
+  VARS
+};
+
+static int symbol_compare(const void *a, const void *b) {
+  const struct symbol *sa = a, *sb = b;
+
+  return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+/**
+  Read function symbols, local ones included, as static functions are
+  what we're after. simavr's own symbol table skips some of them. Also
+  find the variables above.
+*/
+static int symbols_load(const char *path) {
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  Elf_Data *data;
+  const char *name;
+  int fd, i, n, v;
+
+  elf_version(EV_CURRENT);
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || ! (elf = elf_begin(fd, ELF_C_READ, NULL))) {
+    return -1;
+  }
+
+  while ((scn = elf_nextscn(elf, scn))) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    data = elf_getdata(scn, NULL);
+    n = shdr.sh_size / shdr.sh_entsize;
+    for (i = 0; i < n && symbol_count < MAX_SYMBOLS; i++) {
+      gelf_getsym(data, i, &sym);
+      name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+      // RAM symbols are at 0x800000 and up, the rest is the address in
+      // data space.
+      if (sym.st_value >= 0x800000 && sym.st_shndx != SHN_UNDEF) {
+        for (v = 0; v < VARS; v++) {
+          if ( ! strcmp(name, variables[v].name)) {
+            variables[v].addr = sym.st_value & 0xFFFF;
+          }
+        }
+      }
+      // Functions are in flash.
+      if ((GELF_ST_TYPE(sym.st_info) != STT_FUNC &&
+           GELF_ST_TYPE(sym.st_info) != STT_NOTYPE) ||
+          sym.st_shndx == SHN_UNDEF || sym.st_shndx == SHN_ABS ||
+          sym.st_value >= 0x800000) {
+        continue;
+      }
+      symbols[symbol_count].name = strdup(name);
+      symbols[symbol_count].addr = sym.st_value;
+      symbols[symbol_count].size = sym.st_size;
+      symbol_count++;
+    }
+  }
+  elf_end(elf);
+  close(fd);
+
+  qsort(symbols, symbol_count, sizeof(symbols[0]), symbol_compare);
+  return 0;
+}
+
+static struct symbol *symbol_named(const char *name) {
+  int i;
+
+  for (i = 0; i < symbol_count; i++) {
+    if ( ! strcmp(symbols[i].name, name)) {
+      return &symbols[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+  The function containing addr. Assembly labels come without size, they
+  reach up to the next symbol.
+*/
+static const char *symbol_at(uint32_t addr) {
+  int i;
+
+  for (i = symbol_count - 1; i >= 0; i--) {
+    if (symbols[i].addr <= addr &&
+        (symbols[i].size == 0 || addr < symbols[i].addr + symbols[i].size)) {
+      return symbols[i].name;
+    }
+  }
+  return "?";
+}
+
+
+/* ---- Comparator script ------------------------------------------------- */
+
+static uint16_t script[MAX_SCRIPT] = {
+  5800, 5850, 5900, 6000, 6143, 6144, 6300, 6500,
+  6200, 6000, 5800, 5700, 5631, 5632, 5400, 5300,
+  5500, 5700, 0x17FF, 0x1800, 5800, 5800, 5800, 5800,
+};
+static int script_length = 24, script_next;
+
+static avr_t *avr;
+static avr_irq_t *ain0;
+
+static avr_cycle_count_t charge_done(avr_t *sim, avr_cycle_count_t when,
+                                     void *param) {
+  avr_raise_irq(ain0, AIN0_FULL_MV);
+  return 0;
+}
+
+static void sensor_pin(struct avr_irq_t *irq, uint32_t value, void *param) {
+
+  if (value) {
+    avr_cycle_timer_register(avr, script[script_next] * 8ULL,
+                             charge_done, NULL);
+    script_next = (script_next + 1) % script_length;
+  }
+  else {
+    avr_cycle_timer_cancel(avr, charge_done, NULL);
+    avr_raise_irq(ain0, 0);
+  }
+}
+
+static int script_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  unsigned int count;
+
+  if ( ! f) {
+    return -1;
+  }
+  script_length = 0;
+  while (script_length < MAX_SCRIPT && fscanf(f, "%u", &count) == 1) {
+    script[script_length++] = count;
+  }
+  fclose(f);
+  return script_length ? 0 : -1;
+}
+
+/**
+  Motor pin changes, to tell regulation passes with and without movement
+  apart.
+*/
+static uint32_t motor_changes;
+
+static void motor_pin(struct avr_irq_t *irq, uint32_t value, void *param) {
+  motor_changes++;
+}
+
+
+/* ---- USB requests ------------------------------------------------------ */
+
+/**
+  SETUP packets to inject, in turn. Standard requests of an enumeration,
+  then vendor requests as terminal.py sends them, reading only, so the
+  firmware runs as without them. Requests a build doesn't know get the
+  default answer.
+*/
+static const uint8_t requests[][8] = {
+  { 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00 },  // GET_STATUS
+  { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 },  // device descriptor
+  { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xFF, 0x00 },  // configuration
+  { 0x80, 0x06, 0x01, 0x03, 0x09, 0x04, 0xFF, 0x00 },  // string 1
+  { 0xC0, 'c',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 't',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'm',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },  // MEASURE_NOW
+  { 0xC0, 'd',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'W',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'h',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'r',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'n',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 's',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'Q',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+  { 0xC0, 'Y',  0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 },
+};
+
+#define REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+static uint32_t request_next, requests_done;
+
+/**
+  Whether the next usbPoll() has work: a received packet, or a reply to
+  build while transmission is idle.
+*/
+static uint8_t usb_pending(void) {
+
+  if ( ! variables[VAR_RX_LEN].addr) {
+    return 0;
+  }
+  return (int8_t)avr->data[variables[VAR_RX_LEN].addr] >= 3 ||
+         ((avr->data[variables[VAR_TX_LEN].addr] & 0x10) &&
+          avr->data[variables[VAR_MSG_LEN].addr] != USB_NO_MSG);
+}
+
+/**
+  Put the next SETUP packet into the receive buffer, as V-USB's interrupt
+  does. Returns zero if the buffer is still taken.
+*/
+static uint8_t request_inject(void) {
+  uint16_t at;
+  uint8_t i;
+
+  if (avr->data[variables[VAR_RX_LEN].addr]) {
+    return 0;
+  }
+  // usbPoll() reads from the half the interrupt doesn't receive into.
+  at = variables[VAR_RX_BUF].addr + USB_BUFSIZE -
+       avr->data[variables[VAR_INPUT_BUF_OFFSET].addr];
+  avr->data[at] = USBPID_SETUP;
+  for (i = 0; i < 8; i++) {
+    avr->data[at + 1 + i] = requests[request_next][i];
+  }
+  // CRC, usbPoll() doesn't check it.
+  avr->data[at + 9] = 0;
+  avr->data[at + 10] = 0;
+  avr->data[variables[VAR_RX_TOKEN].addr] = USBPID_SETUP;
+  avr->data[variables[VAR_RX_LEN].addr] = USB_BUFSIZE;
+
+  request_next = (request_next + 1) % REQUESTS;
+  requests_done++;
+  return 1;
+}
+
+
+/* ---- Measurements ------------------------------------------------------ */
+
+enum {
+  PATH_ANA_COMP,
+  PATH_USBPOLL,
+  PATH_USBPOLL_REQUEST,
+  PATH_REGULATE,
+  PATH_REGULATE_MOVE,
+  PATHS
+};
+
+static struct path {
+  const char *label;
+  uint32_t addr;
+  uint8_t found;
+  uint32_t count;
+  uint64_t min, max, total;
+} paths[PATHS] = {
+  { "ANA_COMP_vect" },
+  { "usbPoll" },
+  { "usbPoll+request" },
+  { "regulate" },
+  { "regulate+move" },
+};
+
+static struct {
+  uint8_t path;
+  uint16_t sp;
+  uint32_t motor_changes;
+  uint8_t usb_pending;
+  avr_cycle_count_t start;
+} active[MAX_DEPTH];
+static int depth;
+
+static struct lock {
+  const char *where;
+  uint32_t count;
+  uint64_t max;
+} locks[MAX_SYMBOLS];
+static int lock_count;
+
+static void path_account(uint8_t p, uint64_t cycles) {
+  struct path *path = &paths[p];
+
+  if ( ! path->count || cycles < path->min) {
+    path->min = cycles;
+  }
+  if (cycles > path->max) {
+    path->max = cycles;
+  }
+  path->total += cycles;
+  path->count++;
+}
+
+static void lock_account(const char *where, uint64_t cycles) {
+  int i;
+
+  for (i = 0; i < lock_count; i++) {
+    if (locks[i].where == where || ! strcmp(locks[i].where, where)) {
+      break;
+    }
+  }
+  if (i == lock_count) {
+    if (lock_count == MAX_SYMBOLS) {
+      return;
+    }
+    locks[lock_count].where = where;
+    lock_count++;
+  }
+  locks[i].count++;
+  if (cycles > locks[i].max) {
+    locks[i].max = cycles;
+  }
+}
+
+static uint16_t stack_pointer(void) {
+  return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+/**
+  Where an interrupt lock begins. Interrupt entry locks on the vector table,
+  name these by vector number.
+*/
+static const char *lock_origin(uint32_t pc, int *vector) {
+  static char names[64][16];
+
+  *vector = -1;
+  if (pc < 64 * avr->vector_size) {
+    *vector = pc / avr->vector_size;
+    snprintf(names[*vector], sizeof(names[0]), "vector %d", *vector);
+    return names[*vector];
+  }
+  return symbol_at(pc);
+}
+
+
+int main(int argc, char *argv[]) {
+  const char *elf_path = "build/firmware.elf", *mcu = "attiny2313";
+  int comp_vector = 10, usb_vector = 1, opt, state, vector, p;
+  double seconds = 250.0, interval = 20.0;
+  uint64_t budget = 25ULL * F_CPU / 12000000UL, worst = 0, end;
+  uint64_t request_cycles, next_request = 0;
+  uint8_t interrupts = 0, armed = 0, skip = 0;
+  avr_cycle_count_t lock_start = 0;
+  const char *lock_where = NULL, *worst_where = "-";
+  elf_firmware_t firmware;
+  char vector_name[16];
+  struct symbol *s;
+  uint32_t pc;
+  uint16_t sp;
+  int i;
+
+  while ((opt = getopt(argc, argv, "e:m:v:u:s:b:f:r:")) != -1) {
+    switch (opt) {
+      case 'e': elf_path = optarg; break;
+      case 'm': mcu = optarg; break;
+      case 'v': comp_vector = atoi(optarg); break;
+      case 'u': usb_vector = atoi(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      case 'b': budget = strtoull(optarg, NULL, 0); break;
+      case 'f':
+        if (script_load(optarg)) {
+          fprintf(stderr, "Can't read script %s.\n", optarg);
+          return 2;
+        }
+        break;
+      case 'r': interval = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-e elf] [-m mcu] [-v vector] "
+                        "[-u vector] [-s seconds] [-b budget] "
+                        "[-f script] [-r interval]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(elf_path, &firmware) || symbols_load(elf_path)) {
+    fprintf(stderr, "Can't read %s.\n", elf_path);
+    return 2;
+  }
+  avr = avr_make_mcu_by_name(mcu);
+  if ( ! avr) {
+    fprintf(stderr, "simavr doesn't know %s.\n", mcu);
+    return 2;
+  }
+  avr_init(avr);
+  avr->frequency = F_CPU;
+  avr_load_firmware(avr, &firmware);
+
+  snprintf(vector_name, sizeof(vector_name), "__vector_%d", comp_vector);
+  if ((s = symbol_named(vector_name))) {
+    paths[PATH_ANA_COMP].addr = s->addr;
+    paths[PATH_ANA_COMP].found = 1;
+  }
+  if ((s = symbol_named("usbPoll"))) {
+    paths[PATH_USBPOLL].addr = s->addr;
+    paths[PATH_USBPOLL].found = 1;
+  }
+  request_cycles = (uint64_t)(interval * F_CPU / 1000.0);
+  for (i = 0; i < VARS; i++) {
+    if (request_cycles && ! variables[i].addr) {
+      fprintf(stderr, "No variable %s, no USB requests.\n",
+              variables[i].name);
+      request_cycles = 0;
+    }
+  }
+  if ((s = symbol_named("regulate"))) {
+    paths[PATH_REGULATE].addr = s->addr;
+    paths[PATH_REGULATE].found = 1;
+  }
+
+  // Comparator: reference on AIN1, capacitor on AIN0, see pinio.h.
+  ain0 = avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN0);
+  if ( ! ain0) {
+    fprintf(stderr, "simavr has no analog comparator for %s.\n", mcu);
+    return 2;
+  }
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN1),
+                AIN1_MV);
+  avr_raise_irq(ain0, 0);
+
+  // TEMP_C on PD3, TEMP_C2 on PD0, motors on PB3, PB4, PB5, PB7.
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 3),
+                          sensor_pin, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 0),
+                          sensor_pin, NULL);
+  for (i = 3; i <= 7; i++) {
+    if (i != 6) {
+      avr_irq_register_notify(
+        avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i), motor_pin, NULL);
+    }
+  }
+
+  end = (uint64_t)(seconds * F_CPU);
+  while (avr->cycle < end) {
+    state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "Firmware stopped at 0x%04x.\n", avr->pc);
+      return 2;
+    }
+    pc = avr->pc;
+    sp = stack_pointer();
+
+    // Returns. A path is done when its return address got popped.
+    while (depth && sp > active[depth - 1].sp) {
+      depth--;
+      p = active[depth].path;
+      if (p == PATH_REGULATE &&
+          motor_changes != active[depth].motor_changes) {
+        p = PATH_REGULATE_MOVE;
+      }
+      if (p == PATH_USBPOLL && active[depth].usb_pending) {
+        p = PATH_USBPOLL_REQUEST;
+      }
+      path_account(p, avr->cycle - active[depth].start);
+    }
+
+    // Entries.
+    for (p = 0; p < PATHS; p++) {
+      if ( ! paths[p].found || paths[p].addr != pc || depth == MAX_DEPTH ||
+          (depth && active[depth - 1].path == p &&
+           active[depth - 1].sp == sp)) {
+        continue;
+      }
+      active[depth].path = p;
+      active[depth].sp = sp;
+      active[depth].start = avr->cycle;
+      active[depth].motor_changes = motor_changes;
+      active[depth].usb_pending = (p == PATH_USBPOLL && usb_pending());
+      depth++;
+    }
+
+    // Requests, between two calls of usbPoll().
+    if (request_cycles && avr->cycle >= next_request) {
+      for (i = 0; i < depth && active[i].path != PATH_USBPOLL; i++)
+        ;
+      if (i == depth && request_inject()) {
+        next_request = avr->cycle + request_cycles;
+      }
+    }
+
+    // Interrupt locks, from the first sei() on. Before that, USB isn't
+    // connected yet.
+    if (avr->sreg[S_I] != interrupts) {
+      interrupts = avr->sreg[S_I];
+      if ( ! interrupts) {
+        lock_start = avr->cycle;
+        lock_where = lock_origin(pc, &vector);
+        skip = (vector == usb_vector);
+      }
+      else if (armed && ! skip) {
+        lock_account(lock_where, avr->cycle - lock_start);
+        if (avr->cycle - lock_start > worst) {
+          worst = avr->cycle - lock_start;
+          worst_where = lock_where;
+        }
+      }
+      armed = 1;
+    }
+  }
+
+  printf("path,count,min,max,mean\n");
+  for (p = 0; p < PATHS; p++) {
+    if (paths[p].count) {
+      printf("%s,%u,%llu,%llu,%llu\n", paths[p].label, paths[p].count,
+             (unsigned long long)paths[p].min,
+             (unsigned long long)paths[p].max,
+             (unsigned long long)(paths[p].total / paths[p].count));
+    }
+    else {
+      printf("%s,0,,,\n", paths[p].label);
+    }
+  }
+
+  printf("\nlock,count,max\n");
+  for (i = 0; i < lock_count; i++) {
+    printf("%s,%u,%llu\n", locks[i].where, locks[i].count,
+           (unsigned long long)locks[i].max);
+  }
+
+  printf("\nbudget,worst,where,result\n");
+  printf("%llu,%llu,%s,%s\n", (unsigned long long)budget,
+         (unsigned long long)worst, worst_where,
+         worst > budget ? "FAIL" : "pass");
+
+  if (request_cycles && ! paths[PATH_USBPOLL_REQUEST].count) {
+    fprintf(stderr, "No request got processed, %u injected.\n",
+            requests_done);
+    return 2;
+  }
+  if ( ! paths[PATH_ANA_COMP].count) {
+    fprintf(stderr, "Comparator never triggered, script not working.\n");
+    return 2;
+  }
+  return worst > budget;
+}
@@ -79,7 +79,11 @@ section at the end of this file).
 
 /* --------------------------- Functional Range ---------------------------- */
 
+#ifdef ALARMS    /* see main.c */
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    1
+#else
 #define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#endif
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
@@ -176,7 +180,11 @@ section at the end of this file).
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
+#ifdef FRAME_SYNC    /* see main.c */
+#define USB_COUNT_SOF                   1
+#else
 #define USB_COUNT_SOF                   0
+#endif
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
@@ -29,6 +29,9 @@
 import sys
 import usb.core
 import time
+import argparse
+import subprocess
+import struct
 
 class ISTAtrolPort:
   def __init__(self, idVendor = 0x16c0, idProduct = 0x05e1):
@@ -84,22 +87,404 @@ class ISTAtrolPort:
       elif chr(result[2]) == '-':
         valveText = "  (Valve closed)"
 
+    # Firmware built with DUAL_VALVE appends the same three bytes for the
+    # second radiator.
+    if len(result) >= 6:
+      readingC2 = result[4] * 256 + result[3]
+      tempC2 = -0.00791 * readingC2 + 71.445927
+      valveText += "\t%5d\t%2.1f°C" % (readingC2, tempC2)
+      if readingC != self.lastC: # Both valves regulate at the same time.
+        if chr(result[5]) == '+':
+          valveText += "  (Valve 2 opened)"
+        elif chr(result[5]) == '-':
+          valveText += "  (Valve 2 closed)"
+
     print("%5d\t%5d\t%2.1f°C\t%s%s" % (self.count, result[1] * 256 + result[0],
                                        tempC, time.strftime("%X"), valveText))
     self.count += 1
     self.lastC = readingC
 
+  def inject(self, celsius, timeout, valve = 0):
+    # Feed an external temperature into the virtual sensor of firmware built
+    # with EXTERNAL_SENSOR. Inverse of the calibration formula in do().
+    # 'timeout' is in seconds, roughly.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    reading = int(round((71.445927 - celsius) / 0.00791))
+    reading = max(0, min(reading, 65535))
+    self.dev.ctrl_transfer(0xC0, ord('e') + valve, reading, timeout, 0)
+
+  def supply(self):
+    # Supply measurement of firmware built with SUPPLY_COMPENSATION. Motor
+    # run times get scaled by supplyScale / SUPPLY_SCALE_NOMINAL.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('s'), 0, 0, 2)
+    print("supply_scale: %d" % (result[1] * 256 + result[0]))
+
+  def noise(self):
+    # Motor noise statistics of firmware built with MOTOR_NOISE_STATS.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('n'), 0, 0, 4)
+    pulses = result[1] * 256 + result[0]
+    triggers = result[3] * 256 + result[2]
+    print("motor movements: %d, comparator triggers while moving: %d (%.2f "
+          "per movement)" % (pulses, triggers, triggers / max(pulses, 1)))
+
+  def sync(self, phase):
+    # Have all controllers on this host with firmware built with FRAME_SYNC
+    # measure in the same USB frame, 'phase' milliseconds into each
+    # FRAME_SYNC_PERIOD. pyusb can't read the USB frame number, so the wall
+    # clock in milliseconds stands in for it. Good enough if all devices get
+    # the same; syncing hosts with NTP even aligns fleets across hosts.
+    for dev in usb.core.find(find_all = True, idVendor = self.idVendor,
+                             idProduct = self.idProduct):
+      frame = int(time.time() * 1000) & 0xffff
+      dev.ctrl_transfer(0xC0, ord('y'), frame, phase, 0)
+
+  def frame(self):
+    # Frame state of firmware built with FRAME_SYNC.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('Y'), 0, 0, 4)
+    now = result[1] * 256 + result[0]
+    sampled = result[3] * 256 + result[2]
+    print("frame now: %d, last measurement started in frame: %d" %
+          (now, sampled))
+
+  def alarmLimit(self, index, value):
+    # Change an alarm limit of firmware built with ALARMS. Index order:
+    # frost, rate, stuck moves, sensor minimum.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    self.dev.ctrl_transfer(0xC0, ord('a'), value, index, 0)
+
+  def alarms(self):
+    # Wait for alarm events of firmware built with ALARMS on the interrupt
+    # endpoint and print them as they arrive.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    names = ((0x01, "frost"), (0x02, "warming while closed"),
+             (0x04, "valve stuck"), (0x08, "sensor fault"))
+    while 1:
+      try:
+        event = self.dev.read(0x81, 4, 0)
+      except usb.core.USBTimeoutError:
+        continue
+      reading = event[3] * 256 + event[2]
+      active = [name for (bit, name) in names if event[1] & bit]
+      print("%s  valve %d: %s\t%5d\t%2.1f°C" %
+            (time.strftime("%X"), event[0] + 1,
+             ", ".join(active) if active else "all clear",
+             reading, -0.00791 * reading + 71.445927))
+
+  def plan(self, spec, bound):
+    # Load and start a move plan on firmware built with MOVE_PLAN. 'spec' is
+    # a comma separated list of AT:MOVE[:EXPECT], AT in main loop passes,
+    # MOVE like "+200" (open 200 ms), "-400" (close), "2+200" (second valve)
+    # or "0" (checkpoint only), EXPECT an expected reading.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    # The firmware ignores plan requests while a planned movement runs, so
+    # wait until stopping took effect. Movements take seconds at most.
+    for attempt in range(20):
+      self.dev.ctrl_transfer(0xC0, ord('P'), 0, 0, 0)
+      if self.dev.ctrl_transfer(0xC0, ord('Q'), 0, 0, 4)[0] == 0:
+        break
+      time.sleep(0.5)
+    else:
+      sys.stderr.write("Plan didn't stop.\n")
+      return
+    for entry in spec.split(","):
+      fields = entry.split(":")
+      move = fields[1]
+      run = 0
+      if move.startswith("2"):
+        run |= 0x4000
+        move = move[1:]
+      if move.startswith("+"):
+        run |= 0x8000
+      run |= abs(int(move)) & 0x3fff
+      self.dev.ctrl_transfer(0xC0, ord('p'), int(fields[0]), run, 0)
+      if len(fields) > 2:
+        self.dev.ctrl_transfer(0xC0, ord('q'), int(fields[2]), 0, 0)
+    self.dev.ctrl_transfer(0xC0, ord('P'), bound, 0, 0)
+
+  def planStatus(self):
+    # State of a move plan, see plan().
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('Q'), 0, 0, 4)
+    states = ("idle", "running", "done", "aborted")
+    print("plan %s, next entry %d, plan time %d" %
+          (states[result[0]], result[1], result[3] * 256 + result[2]))
+
+  def raw(self):
+    # Download the raw reading rings of firmware built with RAW_CAPTURE.
+    # One head byte per valve, then RAW_LENGTH records of (uptime, reading)
+    # per valve. With one valve the total is odd, with two it's even.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = bytes(self.dev.ctrl_transfer(0xC0, ord('r'), 0, 0, 254))
+    valves = 1 if len(result) % 2 else 2
+    length = (len(result) - valves) // (4 * valves)
+
+    print("valve\tuptime\treading")
+    for v in range(valves):
+      head = result[v]
+      for i in range(length):
+        offset = valves + (v * length + (head + i) % length) * 4
+        (uptime, reading) = struct.unpack_from("<HH", result, offset)
+        if reading == 0: # Never written.
+          continue
+        print("%d\t%6d\t%5d" % (v + 1, uptime, reading))
+
+  def measureNow(self, sensor):
+    # Fresh reading of firmware built with MEASURE_NOW. Sensor numbers are
+    # SENSOR_* in main.c: 0 = C, 1 = C2, 2 = V, 3 = R. The firmware answers
+    # 'busy' while the comparator is in use, so retry for a while.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    for attempt in range(30):
+      result = self.dev.ctrl_transfer(0xC0, ord('m'), 0, sensor, 5)
+      if result[0] != 1:
+        break
+      time.sleep(0.1)
+
+    if result[0] == 0:
+      raw = result[2] * 256 + result[1]
+      filtered = result[4] * 256 + result[3]
+      print("raw %5d\t%2.1f°C\tfiltered %5d\t%2.1f°C" %
+            (raw, -0.00791 * raw + 71.445927,
+             filtered, -0.00791 * filtered + 71.445927))
+    elif result[0] == 2:
+      print("comparator didn't trigger, sensor broken?")
+    else:
+      print("controller stayed busy, try again")
+
+  def horizon(self):
+    # Prediction horizon per valve of firmware built with ADAPTIVE_HORIZON,
+    # fixed point with 4 fractional bits.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('h'), 0, 0, 4)
+    for v in range(len(result) // 2):
+      print("valve %d: prediction horizon %.2f" %
+            (v + 1, (result[2 * v + 1] * 256 + result[2 * v]) / 16))
+
+  def ripples(self, rippleOpen, rippleClose):
+    # Set ripples per movement of firmware built with RIPPLE_COUNT, zero for
+    # running by time.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    self.dev.ctrl_transfer(0xC0, ord('w'), rippleOpen, rippleClose, 0)
+
+  def travel(self):
+    # Counted motor travel of firmware built with RIPPLE_COUNT. Travel per
+    # valve, then ripples of the last movement, 2 bytes each.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = bytes(self.dev.ctrl_transfer(0xC0, ord('W'), 0, 0, 6))
+    values = struct.unpack("<%dh" % (len(result) // 2), result)
+    for v in range(len(values) - 1):
+      print("valve %d: travel %+d ripples" % (v + 1, values[v]))
+    print("last movement: %d ripples" % (values[-1] & 0xffff))
+
+  def demand(self):
+    # Heat demand of firmware built with HEAT_DEMAND, 0..255, followed by
+    # the estimated position of each valve in movements from closed.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    result = self.dev.ctrl_transfer(0xC0, ord('d'), 0, 0, 3)
+    print("heat demand: %d (%d%%)" % (result[0], result[0] * 100 // 255))
+    for v in range(1, len(result)):
+      print("valve %d: position %d" % (v, result[v]))
+
+  def trace(self):
+    # Download and decode the decision trace of firmware built with
+    # DECISION_TRACE. Record layout matches struct trace_record in main.c.
+    if self.dev is None:
+      sys.stderr.write("No device open.\n")
+      return
+
+    recordFormat = "<HHhHHBB"
+    recordSize = struct.calcsize(recordFormat)
+    result = bytes(self.dev.ctrl_transfer(0xC0, ord('t'), 0, 0, 254))
+    head = result[0]
+    records = [struct.unpack_from(recordFormat, result, 1 + i * recordSize)
+               for i in range((len(result) - 1) // recordSize)]
+    reasons = { ' ': "hold", '-': "close", '+': "open" }
+
+    print("uptime\tvalve\tsource\treading\tslope\tfuture\treason\tpulse")
+    # Oldest first. Records never written have all zeros.
+    for i in range(len(records)):
+      (uptime, temp, slope, future, pulse, reason, flags) = \
+        records[(head + i) % len(records)]
+      if reason == 0:
+        continue
+      print("%6d\t%5d\t%s\t%5d\t%+5d\t%5d\t%s\t%4d ms" %
+            (uptime, flags & 0x01, "ext" if flags & 0x02 else "local",
+             temp, slope, future, reasons.get(chr(reason), chr(reason)),
+             pulse))
+
 
 print("ISTAtrol communications terminal.")
 print("Copyright (C) 2016 Markus \"Traumflug\" Hitter <mah@jump-ing.de>.")
 print("This program is free software and comes with ABSOLUTELY NO WARRANTY;")
 print("for details see license.txt (GPLv3).")
 
+parser = argparse.ArgumentParser()
+parser.add_argument("--external-command", metavar = "CMD",
+                    help = "shell command printing a room temperature in °C, "
+                           "sent to the controller before each reading")
+parser.add_argument("--external-timeout", type = int, default = 180,
+                    metavar = "SECONDS",
+                    help = "how long the controller trusts such a "
+                           "temperature (default: 180)")
+parser.add_argument("--trace", action = "store_true",
+                    help = "print the controller's recent regulation "
+                           "decisions and exit")
+parser.add_argument("--supply", action = "store_true",
+                    help = "print the controller's supply measurement, "
+                           "for calibrating SUPPLY_SCALE_NOMINAL, and exit")
+parser.add_argument("--noise", action = "store_true",
+                    help = "print comparator noise counted during motor "
+                           "movements and exit")
+parser.add_argument("--sync", type = int, metavar = "PHASE",
+                    help = "make all controllers on this host measure in "
+                           "the same USB frame, PHASE ms into the period, "
+                           "and exit")
+parser.add_argument("--frame", action = "store_true",
+                    help = "print the controller's USB frame state and exit")
+parser.add_argument("--alarms", action = "store_true",
+                    help = "print alarm events as the controller sends them")
+parser.add_argument("--alarm-limit", type = int, nargs = 2,
+                    metavar = ("INDEX", "VALUE"),
+                    help = "set an alarm limit (0: frost, 1: rate, "
+                           "2: stuck moves, 3: sensor minimum) and exit")
+parser.add_argument("--plan", metavar = "SPEC",
+                    help = "load and start a move plan, entries "
+                           "AT:MOVE[:EXPECT] separated by commas, and exit")
+parser.add_argument("--plan-bound", type = int, default = 200,
+                    metavar = "READINGS",
+                    help = "allowed deviation from expected readings before "
+                           "the plan aborts (default: 200)")
+parser.add_argument("--plan-status", action = "store_true",
+                    help = "print the state of the move plan and exit")
+parser.add_argument("--raw", action = "store_true",
+                    help = "print the controller's latest raw readings "
+                           "and exit")
+parser.add_argument("--measure-now", type = int, metavar = "SENSOR",
+                    help = "measure sensor SENSOR (0 = C, 1 = C2, 2 = V, "
+                           "3 = R) right away, print the result and exit")
+parser.add_argument("--horizon", action = "store_true",
+                    help = "print the learned prediction horizon and exit")
+parser.add_argument("--ripples", type = int, nargs = 2,
+                    metavar = ("OPEN", "CLOSE"),
+                    help = "set motor ripples per open and close movement, "
+                           "0 for running by time, and exit")
+parser.add_argument("--travel", action = "store_true",
+                    help = "print counted valve motor travel and exit")
+parser.add_argument("--demand", action = "store_true",
+                    help = "print the controller's heat demand and exit")
+args = parser.parse_args()
+
 dev = ISTAtrolPort()
 dev.open()
 
+if args.trace:
+  dev.trace()
+  sys.exit(0)
+
+if args.supply:
+  dev.supply()
+  sys.exit(0)
+
+if args.noise:
+  dev.noise()
+  sys.exit(0)
+
+if args.raw:
+  dev.raw()
+  sys.exit(0)
+
+if args.horizon:
+  dev.horizon()
+  sys.exit(0)
+
+if args.ripples:
+  dev.ripples(*args.ripples)
+  sys.exit(0)
+
+if args.travel:
+  dev.travel()
+  sys.exit(0)
+
+if args.demand:
+  dev.demand()
+  sys.exit(0)
+
+if args.measure_now is not None:
+  dev.measureNow(args.measure_now)
+  sys.exit(0)
+
+if args.sync is not None:
+  dev.sync(args.sync)
+  sys.exit(0)
+
+if args.frame:
+  dev.frame()
+  sys.exit(0)
+
+if args.plan:
+  dev.plan(args.plan, args.plan_bound)
+  sys.exit(0)
+
+if args.plan_status:
+  dev.planStatus()
+  sys.exit(0)
+
+if args.alarm_limit:
+  dev.alarmLimit(*args.alarm_limit)
+  sys.exit(0)
+
+if args.alarms:
+  dev.alarms()
+
 while 1:
   try:
+    if args.external_command:
+      output = subprocess.check_output(args.external_command, shell = True)
+      dev.inject(float(output), args.external_timeout)
     dev.do()
   except:
     print(sys.exc_info())